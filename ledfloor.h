@@ -4,14 +4,172 @@
 #include <linux/ioctl.h>
 #include <linux/types.h>
 
+/* Default floor geometry, see LF_IOCSGEOMETRY */
 #define LFROWS 24
 #define LFCOLS 48
+/* Largest geometry the driver handles. Each row is driven by its own data
+ * line, data lines can be spread over two 32 bit ports. */
+#define LF_MAXROWS 64
+#define LF_MAXCOLS 128
+
+/* Pixel formats, see LF_IOCSFORMAT */
+/* 8 bit R, G, B components, corrected with the look up tables */
+#define LF_FMT_RGB888 0
+/* 16 bit R, G, B components in host byte order, already gamma corrected. The
+ * 12 most significant bits are used as PWM values. */
+#define LF_FMT_RGB16 1
+/* Indexes in the palette set with LF_IOCSPALETTE */
+#define LF_FMT_INDEX8 2
+/* 16 bit pixels in host byte order, R in the 5 most significant bits, then 6
+ * bits of G and 5 of B */
+#define LF_FMT_RGB565 3
+/* 4 bit R, G, B components, two pixels packed in three bytes, most
+ * significant nibble first */
+#define LF_FMT_RGB444 4
+#define LF_FMT_NB 5
+#define LF_FMT_BITS(format) ((format) == LF_FMT_RGB16 ? 48 : \
+	(format) == LF_FMT_INDEX8 ? 8 : (format) == LF_FMT_RGB565 ? 16 : \
+	(format) == LF_FMT_RGB444 ? 12 : 24)
+#define LF_FRAME_SIZE(rows, cols, format) (((rows) * (cols) * \
+		LF_FMT_BITS(format) + 7) / 8)
+#define LF_MAX_FRAME_SIZE LF_FRAME_SIZE(LF_MAXROWS, LF_MAXCOLS, LF_FMT_RGB16)
 
 #define LF_IOC_MAGIC 0x88
 #define LF_IOCSLATCHNDELAY _IOW(LF_IOC_MAGIC, 0, unsigned int)
 #define LF_IOCSCLKNDELAY _IOW(LF_IOC_MAGIC, 1, unsigned int)
+/* One table used for the R, G and B components, 12 bit values with their
+ * bit order reversed and inverted, see gammatable.py */
 #define LF_IOCSGAMMATABLE _IOW(LF_IOC_MAGIC, 2, uint16_t[256])
-#define LF_IOC_NB 3
+/* fnum of the frame being read on this file */
+#define LF_IOCGFNUM _IOR(LF_IOC_MAGIC, 3, uint32_t)
+/* Frame slots that can be mmap()ed. Slot n starts at offset
+ * n * LF_SLOT_SIZE(page size) and holds one frame of pixels. A producer fills
+ * the slot returned by LF_IOCGSLOT, then passes it to LF_IOCCOMMIT to have it
+ * displayed, which returns the next slot to fill.
+ */
+#define LF_SLOTS 3
+#define LF_SLOT_SIZE(page_size) ((LF_MAX_FRAME_SIZE + (page_size) - 1) & \
+		~((page_size) - 1))
+#define LF_IOCGSLOT _IOR(LF_IOC_MAGIC, 4, uint32_t)
+#define LF_IOCCOMMIT _IOWR(LF_IOC_MAGIC, 5, uint32_t)
+/* Wait until frame number N has been clocked out, N is replaced by the
+ * current fnum. N = 0 only returns the current fnum. */
+#define LF_IOCWAITFRAME _IOWR(LF_IOC_MAGIC, 6, uint32_t)
+/* Floor geometry, rows can't be more than the number of data lines wired */
+#define LF_IOCSGEOMETRY _IOW(LF_IOC_MAGIC, 7, struct lf_geometry)
+#define LF_IOCGGEOMETRY _IOR(LF_IOC_MAGIC, 8, struct lf_geometry)
+/* Clock period and latch delay achieved by the last frame clocked out,
+ * ENODATA if there was none. LF_IOCSCLKNDELAY sets the duration of each
+ * half clock period and LF_IOCSLATCHNDELAY the delay before and after the
+ * latch edge, they are minimums measured with the cycle counter. */
+#define LF_IOCGTIMING _IOR(LF_IOC_MAGIC, 9, struct lf_timing)
+/* One table per component, in R, G, B order, giving the 12 bit PWM value
+ * for each 8 bit value. Gamma, contrast and brightness are meant to be
+ * folded in. Takes effect from the next frame rendered on. */
+#define LF_IOCSLUTS _IOW(LF_IOC_MAGIC, 10, struct lf_luts)
+/* Pixel format of the frames written or committed from now on, LF_FMT_* */
+#define LF_IOCSFORMAT _IOW(LF_IOC_MAGIC, 11, uint32_t)
+#define LF_IOCGFORMAT _IOR(LF_IOC_MAGIC, 12, uint32_t)
+/* Palette of LF_FMT_INDEX8, its colours go through the look up tables */
+#define LF_IOCSPALETTE _IOW(LF_IOC_MAGIC, 13, struct lf_palette)
+/* Replace a rectangle of the frame being staged with width * height pixels
+ * in the current format, not LF_FMT_RGB444. Only the columns covered are
+ * converted again. The frame staged starts as a copy of the last one
+ * written or committed. With LF_UPDATE_COMMIT, it is then displayed. */
+#define LF_IOCUPDATE _IOW(LF_IOC_MAGIC, 14, struct lf_update)
+/* Queue count frames in the current format, laid one after the other at
+ * pixels, to be latched at the CLOCK_MONOTONIC times in nanoseconds at pts,
+ * which must not go back in time. Frames queued take precedence over the
+ * ones written or committed. When several are due, all but the last are
+ * skipped. Blocks while the queue is full unless O_NONBLOCK, count is set
+ * to the number of frames queued. With LF_QUEUE_FLUSH, the frames still
+ * queued are dropped first. EINVAL unless the module was loaded with a
+ * queue_len. */
+#define LF_IOCQUEUE _IOWR(LF_IOC_MAGIC, 15, struct lf_queue)
+/* Layout of the floor, the pixel shown by each LED. pixels holds rows *
+ * cols indexes, y * cols + x, pixels[i * cols + k] for LED k of the chain
+ * on data line i, LED 0 being the nearest to the board. With LF_MAP_BGR, the
+ * components of every LED are in B, G, R order along the chain. A NULL
+ * pixels goes back to the layout of the rotate setting, row i on chain i
+ * and column k on LED k, or everything reversed when rotated. Setting the
+ * geometry also goes back to it. */
+#define LF_IOCSMAP _IOW(LF_IOC_MAGIC, 16, struct lf_map)
+/* Uniformity calibration. Component c of pixel y * cols + x has its PWM
+ * value scaled by gains[classes[(y * cols + x) * 3 + c]] / LF_GAIN_ONE,
+ * saturating. The look up tables are derived for each class beforehand, so
+ * calibrated frames take no longer to render. A NULL classes puts every
+ * component in class 0, as does setting the geometry. LF_FMT_RGB16 frames
+ * don't go through the tables and aren't calibrated. */
+#define LF_IOCSGAINS _IOW(LF_IOC_MAGIC, 17, struct lf_gains)
+#define LF_IOC_NB 18
+
+#define LF_UPDATE_COMMIT 1
+#define LF_QUEUE_FLUSH 1
+#define LF_MAP_BGR 1
+
+#define LF_GAIN_CLASSES 8
+#define LF_GAIN_ONE 0x8000
+
+struct lf_geometry {
+	uint32_t rows;
+	uint32_t cols;
+};
+
+struct lf_timing {
+	uint32_t cycles_khz;
+	uint32_t clk_period_ns;
+	uint32_t latch_ns;
+};
+
+struct lf_luts {
+	uint16_t channels[3][256];
+};
+
+struct lf_update {
+	uint32_t x;
+	uint32_t y;
+	uint32_t width;
+	uint32_t height;
+	const uint8_t *pixels;
+	uint32_t flags;
+};
+
+struct lf_queue {
+	uint32_t count;
+	uint32_t flags;
+	const int64_t *pts;
+	const uint8_t *pixels;
+};
+
+struct lf_map {
+	uint32_t flags;
+	const uint16_t *pixels;
+};
+
+struct lf_gains {
+	uint16_t gains[LF_GAIN_CLASSES];
+	const uint8_t *classes;
+};
+
+struct lf_palette {
+	uint8_t rgb[256][3];
+};
+
+/* lfserver datagrams. One of exactly rows * cols * 3 bytes is an
+ * LF_FMT_RGB888 frame, any other starts with struct lf_packet. */
+#define LF_PACKET_MAGIC "LF"
+/* Followed by a frame in format. The 16 bit pixels or components of
+ * LF_FMT_RGB565 and LF_FMT_RGB16 are in network byte order, like the fields
+ * of struct command_t. */
+#define LF_PACKET_FRAME 0
+/* Followed by a struct lf_palette, format is not used */
+#define LF_PACKET_PALETTE 1
+
+struct lf_packet {
+	char magic[2];
+	uint8_t type;
+	uint8_t format;
+};
 
 struct command_t {
 	__be32 latch_ndelay;
@@ -0,0 +1,885 @@
+/* Copyright 2010 Benjamin Poirier, benjamin.poirier@gmail.com
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifdef __KERNEL__
+#include <linux/errno.h>
+#include <linux/kernel.h>
+#include <linux/string.h>
+#else
+#include <errno.h>
+#include <string.h>
+#endif
+
+#include "ledfloor_engine.h"
+
+/* Gamma correction table, gamma = 2.2, upconvert 8 to 12 bits, reverse the
+ * bit order and invert the bits
+ * Generated using gammatable.py
+ */
+const uint16_t gamma_c[256] = {
+	4095, 4095, 4095, 4095, 4095, 2047, 2047, 3071, 3071, 1023, 1023,
+	3583, 1535, 2559, 511, 3839, 1791, 767, 3327, 2303, 255, 1919, 895,
+	1407, 383, 1663, 639, 1151, 4031, 3007, 1471, 3775, 703, 2239, 1855,
+	3391, 319, 575, 2111, 3039, 2527, 1759, 1247, 2911, 2399, 2655, 95,
+	927, 3743, 1183, 2847, 287, 3103, 2031, 495, 3311, 2927, 3695, 2159,
+	3503, 2735, 3887, 2351, 1071, 3535, 2767, 1871, 3663, 3983, 399, 2191,
+	2319, 2063, 1527, 1271, 1399, 2167, 2487, 2231, 311, 4055, 3799, 1879,
+	599, 3479, 1175, 279, 4071, 2791, 3431, 2151, 3751, 807, 1063, 3783,
+	839, 1095, 3719, 3335, 7, 2811, 2427, 1979, 1211, 1595, 1499, 2907,
+	2139, 667, 283, 3563, 1899, 2155, 683, 1579, 2507, 3403, 2955, 3851,
+	2059, 3315, 2675, 1715, 307, 2515, 1363, 3475, 3347, 995, 2915, 2979,
+	2851, 3011, 2883, 2947, 771, 1021, 3453, 1469, 2365, 477, 3677, 2717,
+	541, 1261, 109, 1837, 973, 1357, 3725, 2573, 1269, 4021, 821, 2517,
+	2645, 1173, 2021, 1381, 1701, 1061, 1861, 1413, 2565, 249, 3513, 1593,
+	2265, 921, 1561, 2281, 3497, 2601, 3913, 2441, 1033, 881, 2737, 2001,
+	3665, 145, 2529, 2145, 2337, 1217, 1409, 1025, 2430, 2238, 478, 94,
+	3614, 1902, 686, 3534, 2126, 270, 1910, 694, 1494, 3990, 2582, 1382,
+	166, 2758, 2438, 2042, 3194, 3642, 3418, 154, 3306, 3754, 3530, 1930,
+	1034, 2674, 306, 3410, 2834, 226, 1186, 706, 1666, 508, 1468, 3548,
+	2972, 2028, 4012, 44, 76, 2060, 2164, 2100, 1108, 2068, 2148, 2084,
+	68, 4088, 1976, 3032, 920, 3560, 2472, 3784, 2696, 3312, 2224, 3920,
+	784, 2400, 1568, 3136, 0
+};
+
+#if LFROWS % 8
+#error "The specialized output path works on groups of 8 rows"
+#endif
+
+/* Transpose an 8x8 bit matrix held in two words, one row per byte with the
+ * first row in the most significant byte of x. From Hacker's Delight,
+ * section 7-3.
+ */
+static inline void transpose8(uint32_t *x, uint32_t *y)
+{
+	uint32_t t;
+
+	t = (*x ^ (*x >> 7)) & 0x00aa00aa;
+	*x = *x ^ t ^ (t << 7);
+	t = (*y ^ (*y >> 7)) & 0x00aa00aa;
+	*y = *y ^ t ^ (t << 7);
+
+	t = (*x ^ (*x >> 14)) & 0x0000cccc;
+	*x = *x ^ t ^ (t << 14);
+	t = (*y ^ (*y >> 14)) & 0x0000cccc;
+	*y = *y ^ t ^ (t << 14);
+
+	t = (*x & 0xf0f0f0f0) | ((*y >> 4) & 0x0f0f0f0f);
+	*y = ((*x << 4) & 0xf0f0f0f0) | (*y & 0x0f0f0f0f);
+	*x = t;
+}
+
+/* Turn the 12 bit values of one column component into the 12 words that are
+ * output on the data port, output_values[k] holds bit k of every value,
+ * value j being on bit j.
+ *
+ * Values are processed in ngroups groups of 8, the low byte and the high
+ * nibble of the values of a group are each transposed as an 8x8 bit matrix.
+ * The values are packed last one first so that the transposed bytes come out
+ * with value j on bit j.
+ */
+static inline void transpose_col_component(const uint16_t *component_values,
+	uint32_t output_values[12], const unsigned int ngroups)
+{
+	int g, k;
+
+	for (k = 0; k < 12; k++) {
+		output_values[k] = 0;
+	}
+
+	for (g = 0; g < ngroups; g++) {
+		const uint16_t *v = &component_values[g * 8];
+		const unsigned int shift = g * 8;
+		uint32_t p0, p1, p2, p3;
+		uint32_t lo_x, lo_y, hi_x, hi_y;
+
+		p0 = v[7] << 16 | v[5];
+		p1 = v[6] << 16 | v[4];
+		p2 = v[3] << 16 | v[1];
+		p3 = v[2] << 16 | v[0];
+
+		lo_x = (p0 & 0x00ff00ff) << 8 | (p1 & 0x00ff00ff);
+		lo_y = (p2 & 0x00ff00ff) << 8 | (p3 & 0x00ff00ff);
+		hi_x = (p0 & 0x0f000f00) | (p1 & 0x0f000f00) >> 8;
+		hi_y = (p2 & 0x0f000f00) | (p3 & 0x0f000f00) >> 8;
+
+		transpose8(&lo_x, &lo_y);
+		transpose8(&hi_x, &hi_y);
+
+		/* Row k of the transposed matrix is in byte 7 - k */
+		for (k = 0; k < 4; k++) {
+			output_values[k] |= ((lo_y >> (k * 8)) & 0xff) << shift;
+			output_values[k + 4] |= ((lo_x >> (k * 8)) & 0xff) <<
+				shift;
+			output_values[k + 8] |= ((hi_y >> (k * 8)) & 0xff) <<
+				shift;
+		}
+	}
+}
+
+/* The straightforward bit by bit version of transpose_col_component(), kept
+ * as a reference for ledfloor_transpose_bench().
+ */
+static void transpose_col_component_serial(uint16_t
+	component_values[LFROWS], uint32_t output_values[12])
+{
+	int j, k;
+
+	for (k = 0; k < 12; k++) {
+		uint32_t output_value = 0;
+
+		for (j = LFROWS - 1; j >= 0; j--) {
+			output_value <<= 1;
+			output_value |= component_values[j] & 1;
+			component_values[j] >>= 1;
+		}
+		output_values[k] = output_value;
+	}
+}
+
+/* Check that both transpose implementations agree and measure how many
+ * cycles each one takes to convert a frame worth of column components.
+ */
+int ledfloor_transpose_bench(unsigned long *serial_cycles, unsigned long
+	*parallel_cycles)
+{
+	unsigned int i, j;
+	unsigned long start;
+	uint16_t component_values[LFROWS], scratch[LFROWS];
+	uint32_t serial_values[12], parallel_values[12];
+
+	*serial_cycles = 0;
+	*parallel_cycles = 0;
+	for (i = 0; i < LFCOLS * 3; i++) {
+		for (j = 0; j < LFROWS; j++) {
+			component_values[j] = gamma_c[(i * LFROWS + j * 7) &
+				0xff];
+		}
+		memcpy(scratch, component_values, sizeof(scratch));
+
+		start = sysreg_read(COUNT);
+		transpose_col_component_serial(scratch, serial_values);
+		*serial_cycles += sysreg_read(COUNT) - start;
+
+		start = sysreg_read(COUNT);
+		transpose_col_component(component_values, parallel_values,
+			LFROWS / 8);
+		*parallel_cycles += sysreg_read(COUNT) - start;
+
+		if (memcmp(serial_values, parallel_values,
+				sizeof(serial_values))) {
+			return -EIO;
+		}
+	}
+
+	return 0;
+}
+
+/* Convert component c of the pixels shown by one LED of every chain into
+ * its 12 port words for each of the nbanks ports, interleaved. Data line j
+ * of port b outputs pixel indexes[b * 32 + j], through the tables of its
+ * calibration class classes[b * 32 + j], see ledfloor_setup_gains().
+ *
+ * Other formats than LF_FMT_RGB888 are expanded here, as components are
+ * gathered for the transpose. LF_FMT_RGB16 components skip the look up
+ * tables. Their 12 bit values are transposed as they are, reversing and
+ * inverting the bits like gamma_c does is then a matter of taking the words
+ * in reverse order and inverting them.
+ */
+static inline void render_led_component(const void *pixels, const uint16_t
+	*indexes, const uint8_t *classes, const unsigned int c, const unsigned
+	int format, const struct ledfloor_lut *lut, uint32_t *words, const
+	unsigned int ngroups, const unsigned int nbanks)
+{
+	const uint8_t *pixels8 = pixels;
+	const uint16_t *pixels16 = pixels;
+	int b, j, k;
+	/* Only the first 12 bits may be set */
+	uint16_t component_values[32];
+	uint32_t bank_words[12];
+
+	for (b = 0; b < nbanks; b++) {
+		for (j = 0; j < ngroups * 8; j++) {
+			const size_t pixel = indexes[b * 32 + j];
+			const unsigned int class = classes[b * 32 + j];
+			uint16_t value;
+			size_t nibble;
+
+			switch (format) {
+				case LF_FMT_RGB16:
+					component_values[j] = pixels16[pixel *
+						3 + c] >> 4;
+					break;
+
+				case LF_FMT_INDEX8:
+					component_values[j] = lut->palette[
+						class][c][pixels8[pixel]];
+					break;
+
+				case LF_FMT_RGB565:
+					value = pixels16[pixel];
+					value = c == 0 ? value >> 11 : c == 1 ?
+						(value >> 5) & 0x3f : value &
+						0x1f;
+					component_values[j] = lut->rgb565[
+						class][c][value];
+					break;
+
+				case LF_FMT_RGB444:
+					nibble = pixel * 3 + c;
+					value = pixels8[nibble / 2] >> (nibble &
+						1 ? 0 : 4);
+					component_values[j] = lut->rgb444[
+						class][c][value & 0xf];
+					break;
+
+				default:
+					component_values[j] = lut->rgb888[
+						class][c][pixels8[pixel *
+						3 + c]];
+			}
+		}
+
+		if (format != LF_FMT_RGB16 && nbanks == 1) {
+			transpose_col_component(component_values, words,
+				ngroups);
+			continue;
+		}
+
+		transpose_col_component(component_values, bank_words,
+			ngroups);
+		for (k = 0; k < 12; k++) {
+			if (format == LF_FMT_RGB16) {
+				words[k * nbanks + b] = ~bank_words[11 - k];
+			}
+			else {
+				words[k * nbanks + b] = bank_words[k];
+			}
+		}
+	}
+}
+
+/* The 3 components of LED led of every chain, in the order in which they
+ * are clocked out. The channel farthest on the chain, and so clocked out
+ * first, is the blue one of an LED, or its red one when engine->bgr. words
+ * is where the words of the LED start.
+ */
+static inline void render_led(const struct ledfloor_engine *engine, const
+	void *pixels, const unsigned int led, const unsigned int format, const
+	struct ledfloor_lut *lut, uint32_t *words, const unsigned int ngroups,
+	const unsigned int nbanks)
+{
+	int channel;
+
+	for (channel = 2; channel >= 0; channel--) {
+		const unsigned int c = engine->bgr ? 2 - channel : channel;
+
+		render_led_component(pixels, engine->gather[led],
+			engine->classes[led][c], c, format, lut, words,
+			ngroups, nbanks);
+		words += 12 * nbanks;
+	}
+}
+
+/* FNV-1a, one word at a time */
+#define FRAME_HASH_INIT 2166136261U
+#define FRAME_HASH_PRIME 16777619U
+
+static inline uint32_t hash_words(uint32_t hash, const uint32_t *words,
+	unsigned int n)
+{
+	unsigned int i;
+
+	for (i = 0; i < n; i++) {
+		hash = (hash ^ words[i]) * FRAME_HASH_PRIME;
+	}
+
+	return hash;
+}
+
+/* Fill out->words with the data port values for pixels, in the order in
+ * which they are clocked out, LED after LED starting with the last one of
+ * the chains. The layout of the floor is applied here through the gather
+ * tables so that any one costs the same, and so that ledfloor_write_frame()
+ * only has to go through words once.
+ *
+ * This is instantiated for the default geometry and format, where the
+ * number of columns, groups of data lines and ports are constants, and for
+ * any other one with each pixel format.
+ */
+static inline void render_geometry(const struct ledfloor_engine *engine,
+	const struct ledfloor_lut *lut, const void *pixels, struct
+	ledfloor_output *out, const unsigned int format, const unsigned int
+	cols, const unsigned int ngroups, const unsigned int nbanks)
+{
+	int led;
+	uint32_t *words = out->words;
+	uint32_t hash = FRAME_HASH_INIT;
+
+	for (led = cols - 1; led >= 0; led--) {
+		render_led(engine, pixels, led, format, lut, words, ngroups,
+			nbanks);
+		hash = hash_words(hash, words, 3 * 12 * nbanks);
+		words += 3 * 12 * nbanks;
+	}
+	out->hash = hash;
+	out->nwords = cols * 3 * 12 * nbanks;
+	memcpy(out->banks, engine->banks, sizeof(out->banks));
+	out->nbanks = nbanks;
+}
+
+static void render_default(const struct ledfloor_engine *engine, const
+	struct ledfloor_lut *lut, const void *pixels, struct ledfloor_output
+	*out)
+{
+	render_geometry(engine, lut, pixels, out, LF_FMT_RGB888, LFCOLS,
+		LFROWS / 8, 1);
+}
+
+static void render_any(const struct ledfloor_engine *engine, const struct
+	ledfloor_lut *lut, const void *pixels, struct ledfloor_output *out)
+{
+	switch (engine->format) {
+		case LF_FMT_RGB16:
+			render_geometry(engine, lut, pixels, out,
+				LF_FMT_RGB16, engine->cols, engine->ngroups,
+				engine->nbanks);
+			break;
+
+		case LF_FMT_INDEX8:
+			render_geometry(engine, lut, pixels, out,
+				LF_FMT_INDEX8, engine->cols, engine->ngroups,
+				engine->nbanks);
+			break;
+
+		case LF_FMT_RGB565:
+			render_geometry(engine, lut, pixels, out,
+				LF_FMT_RGB565, engine->cols, engine->ngroups,
+				engine->nbanks);
+			break;
+
+		case LF_FMT_RGB444:
+			render_geometry(engine, lut, pixels, out,
+				LF_FMT_RGB444, engine->cols, engine->ngroups,
+				engine->nbanks);
+			break;
+
+		default:
+			render_geometry(engine, lut, pixels, out,
+				LF_FMT_RGB888, engine->cols, engine->ngroups,
+				engine->nbanks);
+	}
+}
+
+/* Render again the LEDs showing pixels of the columns col to col + ncols - 1
+ * of out, rendered from pixels with the current geometry, layout and format
+ * of engine. This is not worth specializing, partial updates are small.
+ */
+static inline void render_columns_format(const struct ledfloor_engine
+	*engine, const struct ledfloor_lut *lut, const void *pixels, struct
+	ledfloor_output *out, const unsigned int format, const unsigned int
+	col, const unsigned int ncols)
+{
+	const unsigned int nbanks = engine->nbanks;
+	uint32_t columns[LF_MAXCOLS / 32] = {0};
+	unsigned int i, led;
+
+	for (i = col; i < col + ncols; i++) {
+		columns[i / 32] |= 1 << i % 32;
+	}
+
+	for (led = 0; led < engine->cols; led++) {
+		for (i = 0; i < LF_MAXCOLS / 32; i++) {
+			if (engine->led_columns[led][i] & columns[i]) {
+				break;
+			}
+		}
+		if (i == LF_MAXCOLS / 32) {
+			continue;
+		}
+
+		render_led(engine, pixels, led, format, lut,
+			&out->words[(engine->cols - 1 - led) * 3 * 12 * nbanks],
+			engine->ngroups, nbanks);
+	}
+}
+
+void ledfloor_render_columns(const struct ledfloor_engine *engine, const
+	struct ledfloor_lut *lut, const void *pixels, struct ledfloor_output
+	*out, unsigned int col, unsigned int ncols)
+{
+	switch (engine->format) {
+		case LF_FMT_RGB16:
+			render_columns_format(engine, lut, pixels, out,
+				LF_FMT_RGB16, col, ncols);
+			break;
+
+		case LF_FMT_INDEX8:
+			render_columns_format(engine, lut, pixels, out,
+				LF_FMT_INDEX8, col, ncols);
+			break;
+
+		case LF_FMT_RGB565:
+			render_columns_format(engine, lut, pixels, out,
+				LF_FMT_RGB565, col, ncols);
+			break;
+
+		case LF_FMT_RGB444:
+			render_columns_format(engine, lut, pixels, out,
+				LF_FMT_RGB444, col, ncols);
+			break;
+
+		default:
+			render_columns_format(engine, lut, pixels, out,
+				LF_FMT_RGB888, col, ncols);
+	}
+	out->hash = hash_words(FRAME_HASH_INIT, out->words, out->nwords);
+}
+
+/* Scale the PWM value of an entry in the format of gamma_c by gain /
+ * LF_GAIN_ONE */
+static uint16_t scale_entry(uint16_t entry, uint16_t gain)
+{
+	uint32_t value = 0;
+	uint16_t scaled = 0;
+	int k;
+
+	for (k = 0; k < 12; k++) {
+		value |= ((entry >> k) & 1) << (11 - k);
+	}
+	value = ((value ^ 0xfff) * gain + LF_GAIN_ONE / 2) / LF_GAIN_ONE;
+	if (value > 0xfff) {
+		value = 0xfff;
+	}
+	for (k = 0; k < 12; k++) {
+		scaled |= ((value >> k) & 1) << (11 - k);
+	}
+
+	return scaled ^ 0xfff;
+}
+
+/* Fill the tables of lut used for each calibration class and format from
+ * its channels, gains and palette */
+void ledfloor_derive_lut(struct ledfloor_lut *lut)
+{
+	unsigned int g, c, v;
+
+	for (g = 0; g < LF_GAIN_CLASSES; g++) {
+		for (c = 0; c < 3; c++) {
+			const uint16_t *rgb888 = lut->rgb888[g][c];
+			const unsigned int bits = c == 1 ? 6 : 5;
+
+			for (v = 0; v < 256; v++) {
+				lut->rgb888[g][c][v] = lut->gains[g] ==
+					LF_GAIN_ONE ? lut->channels[c][v] :
+					scale_entry(lut->channels[c][v],
+						lut->gains[g]);
+			}
+			for (v = 0; v < 256; v++) {
+				lut->palette[g][c][v] =
+					rgb888[lut->palette_rgb[v][c]];
+			}
+			/* Replicate the most significant bits in the least
+			 * significant ones, so that the extremes map to 0
+			 * and 255 */
+			for (v = 0; v < 1 << bits; v++) {
+				lut->rgb565[g][c][v] = rgb888[v << (8 - bits)
+					| v >> (2 * bits - 8)];
+			}
+			for (v = 0; v < 16; v++) {
+				lut->rgb444[g][c][v] = rgb888[v * 0x11];
+			}
+		}
+	}
+}
+
+/* Pixels shown by the LEDs of chain i, map[k] for LED k */
+static void set_chain(struct ledfloor_engine *engine, const unsigned int i,
+	const uint16_t *map)
+{
+	const unsigned int line = engine->chain_lines[i];
+	unsigned int k;
+
+	for (k = 0; k < engine->cols; k++) {
+		const unsigned int col = map[k] % engine->cols;
+
+		engine->gather[k][line] = map[k];
+		engine->led_columns[k][col / 32] |= 1 << col % 32;
+	}
+}
+
+/* Derive the ports to write from the geometry and the wiring, data[i]
+ * being the line of chain i, and pick the render implementation. Ports are
+ * used in the order in which they first appear in data.
+ *
+ * Chain i shows row i and its LED k column k, or with rotate, row rows - 1 -
+ * i and column cols - 1 - k with the components in reverse order. Another
+ * layout can then be set with ledfloor_setup_map().
+ */
+int ledfloor_setup_engine(struct ledfloor_engine *engine, const int *data,
+	unsigned int rows, unsigned int cols, bool rotate, unsigned int
+	format)
+{
+	unsigned int i, k, b, nbanks = 0;
+	int bank_numbers[LF_MAXBANKS];
+	uint16_t map[LF_MAXCOLS];
+
+	for (i = 0; i < rows; i++) {
+		for (b = 0; b < nbanks; b++) {
+			if (bank_numbers[b] == GPIO_BANK(data[i])) {
+				break;
+			}
+		}
+		if (b == nbanks) {
+			if (nbanks == LF_MAXBANKS) {
+				return -EINVAL;
+			}
+			bank_numbers[nbanks++] = GPIO_BANK(data[i]);
+		}
+	}
+
+	memset(engine->banks, 0, sizeof(engine->banks));
+	for (b = 0; b < nbanks; b++) {
+		engine->banks[b].base = (void*) (GPIO_HW_BASE + bank_numbers[b]
+			* GPIO_PORT_SIZE);
+		engine->banks[b].port = bank_numbers[b];
+	}
+	engine->nbanks = nbanks;
+	engine->ngroups = 1;
+	for (i = 0; i < rows; i++) {
+		const unsigned int line = GPIO_INDEX(data[i]);
+
+		for (b = 0; bank_numbers[b] != GPIO_BANK(data[i]); b++);
+
+		engine->chain_lines[i] = b * 32 + line;
+		engine->banks[b].data_mask |= 1 << line;
+		if (line / 8 + 1 > engine->ngroups) {
+			engine->ngroups = line / 8 + 1;
+		}
+	}
+	engine->rows = rows;
+	engine->cols = cols;
+	engine->format = format;
+
+	/* Lines that are not wired output the first pixel */
+	memset(engine->gather, 0, sizeof(engine->gather));
+	memset(engine->classes, 0, sizeof(engine->classes));
+	memset(engine->led_columns, 0, sizeof(engine->led_columns));
+	for (i = 0; i < rows; i++) {
+		for (k = 0; k < cols; k++) {
+			map[k] = (rotate ? rows - 1 - i : i) * cols + (rotate ?
+				cols - 1 - k : k);
+		}
+		set_chain(engine, i, map);
+	}
+	engine->bgr = rotate;
+
+	if (cols == LFCOLS && rows == LFROWS && engine->ngroups == LFROWS / 8
+		&& nbanks == 1 && format == LF_FMT_RGB888) {
+		engine->render = render_default;
+	}
+	else {
+		engine->render = render_any;
+	}
+
+	return 0;
+}
+
+/* Compile the layout of the floor, map[i * cols + k] being the index, y *
+ * cols + x, of the pixel shown by LED k of chain i, into the gather tables.
+ * LED 0 is the one nearest to the board. With LF_MAP_BGR, the components
+ * are shown in reverse order. The geometry is the one set up last by
+ * ledfloor_setup_engine(). Every component goes back to calibration class
+ * 0, see ledfloor_setup_gains().
+ */
+int ledfloor_setup_map(struct ledfloor_engine *engine, const uint16_t *map,
+	uint32_t flags)
+{
+	unsigned int i;
+
+	for (i = 0; i < engine->rows * engine->cols; i++) {
+		if (map[i] >= engine->rows * engine->cols) {
+			return -EINVAL;
+		}
+	}
+
+	memset(engine->classes, 0, sizeof(engine->classes));
+	memset(engine->led_columns, 0, sizeof(engine->led_columns));
+	for (i = 0; i < engine->rows; i++) {
+		set_chain(engine, i, &map[i * engine->cols]);
+	}
+	engine->bgr = flags & LF_MAP_BGR;
+
+	return 0;
+}
+
+/* Compile the calibration classes, classes[p * 3 + c] for component c of
+ * pixel p, into tables that follow the gather tables. The layout is the
+ * one set up last, this has to be done again after it changes.
+ */
+int ledfloor_setup_gains(struct ledfloor_engine *engine, const uint8_t
+	*classes)
+{
+	unsigned int i, k, c;
+
+	for (i = 0; i < engine->rows * engine->cols * 3; i++) {
+		if (classes[i] >= LF_GAIN_CLASSES) {
+			return -EINVAL;
+		}
+	}
+
+	for (i = 0; i < engine->rows; i++) {
+		const unsigned int line = engine->chain_lines[i];
+
+		for (k = 0; k < engine->cols; k++) {
+			for (c = 0; c < 3; c++) {
+				engine->classes[k][c][line] = classes[
+					engine->gather[k][line] * 3 + c];
+			}
+		}
+	}
+
+	return 0;
+}
+
+/* The clock and latch lines are written through the set and clear registers
+ * of their port, or with backend LF_BACKEND_GPIOLIB, through the GPIO
+ * framework like the data lines */
+void ledfloor_setup_clock(struct ledfloor_engine *engine, int clk, int
+	latch, unsigned int backend)
+{
+	engine->backend = backend;
+	engine->clk = clk;
+	engine->latch = latch;
+
+	engine->clk_mask = 1 << GPIO_INDEX(clk);
+	engine->clk_reg_set = (void*) (GPIO_HW_BASE + GPIO_BANK(clk) *
+		GPIO_PORT_SIZE + PIO_SODR);
+	engine->clk_reg_clear = (void*) (GPIO_HW_BASE + GPIO_BANK(clk) *
+		GPIO_PORT_SIZE + PIO_CODR);
+
+	engine->latch_mask = 1 << GPIO_INDEX(latch);
+	engine->latch_reg_set = (void*) (GPIO_HW_BASE + GPIO_BANK(latch) *
+		GPIO_PORT_SIZE + PIO_SODR);
+	engine->latch_reg_clear = (void*) (GPIO_HW_BASE + GPIO_BANK(latch) *
+		GPIO_PORT_SIZE + PIO_CODR);
+}
+
+/* Busy wait until the cycle counter reaches deadline. Returns when that
+ * happened, which is later than deadline when it was already missed, so that
+ * the next edge is placed relative to the late one and no clock pulse is
+ * ever shorter than asked for. The time spent waiting is added to *waited.
+ */
+static inline uint32_t wait_edge(uint32_t deadline, uint32_t *waited)
+{
+	uint32_t now = sysreg_read(COUNT);
+
+	if ((int32_t) (now - deadline) >= 0) {
+		return now;
+	}
+
+	*waited += deadline - now;
+	while ((int32_t) (deadline - sysreg_read(COUNT)) > 0) {
+		cpu_relax();
+	}
+
+	return deadline;
+}
+
+/* Raise or lower the clock line */
+static inline void set_clk(const struct ledfloor_engine *engine, const
+	unsigned int backend, const int value)
+{
+	if (backend == LF_BACKEND_GPIOLIB) {
+		gpio_set_value(engine->clk, value);
+	}
+	else {
+		__raw_writel(engine->clk_mask, value ? engine->clk_reg_set :
+			engine->clk_reg_clear);
+	}
+}
+
+static inline void set_latch(const struct ledfloor_engine *engine, const
+	unsigned int backend, const int value)
+{
+	if (backend == LF_BACKEND_GPIOLIB) {
+		gpio_set_value(engine->latch, value);
+	}
+	else {
+		__raw_writel(engine->latch_mask, value ?
+			engine->latch_reg_set : engine->latch_reg_clear);
+	}
+}
+
+/* Set the data lines of bank to word through the GPIO framework. Only the
+ * lines that differ from *levels, the word written last, are written,
+ * neighbouring LEDs often have bits in common.
+ */
+static inline void write_lines(const struct ledfloor_bank *bank, const
+	uint32_t word, uint32_t *levels)
+{
+	uint32_t changed = (word ^ *levels) & bank->data_mask;
+	unsigned int line;
+
+	for (line = 0; changed; line++, changed >>= 1) {
+		if (changed & 1) {
+			gpio_set_value(bank->port * 32 + line, (word >> line) &
+				1);
+		}
+	}
+	*levels = word;
+}
+
+/* Clock edges are placed on absolute deadlines, clk_cycles apart, instead of
+ * waiting clk_ndelay after each register write. The time spent fetching the
+ * next words is then part of the clock period rather than added to it.
+ *
+ * With chunk_cols, the words are clocked out chunk_cols LEDs at a time with
+ * a preemption point in between, 0 or as many as there are LEDs on a chain
+ * being the whole frame at once. The chains only take the data in on the
+ * latch edge, a pause just stretches one clock period. Time spent preempted
+ * is not counted in shift_cycles.
+ *
+ * This is instantiated for each backend, see ledfloor_write_frame().
+ */
+static inline void shift_out(const struct ledfloor_engine *engine, const
+	struct ledfloor_output *out, uint32_t clk_cycles, uint32_t
+	latch_cycles, unsigned int chunk_cols, struct ledfloor_timing
+	*timing, const unsigned int backend)
+{
+	int i, b;
+	unsigned int first, last;
+	/* In LEDs first so that no chunk_cols overflows it */
+	const unsigned int cols = out->nwords / (3 * 12 * out->nbanks);
+	const unsigned int chunk = chunk_cols && chunk_cols < cols ? chunk_cols
+		* 3 * 12 * out->nbanks : out->nwords;
+	uint32_t write_masks[LF_MAXBANKS], levels[LF_MAXBANKS];
+	const uint32_t *words = out->words;
+	uint32_t start, deadline, held, waited = 0;
+
+	timing->shift_cycles = 0;
+	timing->hold_cycles = 0;
+	timing->yields = 0;
+	held = sysreg_read(COUNT);
+	for (b = 0; b < out->nbanks; b++) {
+		if (backend == LF_BACKEND_GPIOLIB) {
+			/* The levels left by the last frame aren't known,
+			 * all lines are written on the first clock */
+			levels[b] = ~words[b];
+			continue;
+		}
+
+		write_masks[b] = __raw_readl(out->banks[b].base + PIO_OWSR);
+		__raw_writel(out->banks[b].data_mask, out->banks[b].base +
+			PIO_OWER);
+	}
+
+	set_latch(engine, backend, 1);
+	start = deadline = sysreg_read(COUNT);
+	for (first = 0; first < out->nwords; first = last) {
+		last = first + chunk < out->nwords ? first + chunk :
+			out->nwords;
+		if (first) {
+			timing->shift_cycles += deadline - start;
+			if (deadline - held > timing->hold_cycles) {
+				timing->hold_cycles = deadline - held;
+			}
+			ledfloor_yield();
+			timing->yields++;
+			held = start = deadline = sysreg_read(COUNT);
+		}
+
+		if (backend == LF_BACKEND_GPIOLIB) {
+			for (i = first; i < last; i += out->nbanks) {
+				set_clk(engine, backend, 1);
+				for (b = 0; b < out->nbanks; b++) {
+					write_lines(&out->banks[b], words[i +
+						b], &levels[b]);
+				}
+
+				deadline = wait_edge(deadline + clk_cycles,
+					&waited);
+				set_clk(engine, backend, 0);
+				deadline = wait_edge(deadline + clk_cycles,
+					&waited);
+			}
+		}
+		else if (out->nbanks == 1) {
+			void *data_reg = out->banks[0].base + PIO_ODSR;
+
+			for (i = first; i < last; i++) {
+				set_clk(engine, backend, 1);
+				__raw_writel(words[i], data_reg);
+
+				deadline = wait_edge(deadline + clk_cycles,
+					&waited);
+				set_clk(engine, backend, 0);
+				deadline = wait_edge(deadline + clk_cycles,
+					&waited);
+			}
+		}
+		else {
+			for (i = first; i < last; i += out->nbanks) {
+				set_clk(engine, backend, 1);
+				for (b = 0; b < out->nbanks; b++) {
+					__raw_writel(words[i + b],
+						out->banks[b].base +
+						PIO_ODSR);
+				}
+
+				deadline = wait_edge(deadline + clk_cycles,
+					&waited);
+				set_clk(engine, backend, 0);
+				deadline = wait_edge(deadline + clk_cycles,
+					&waited);
+			}
+		}
+	}
+	timing->shift_cycles += deadline - start;
+	timing->clocks = out->nwords / out->nbanks;
+
+	start = deadline;
+	deadline = wait_edge(deadline + latch_cycles, &waited);
+	set_latch(engine, backend, 0);
+	timing->latch_cycles = deadline - start;
+	wait_edge(deadline + latch_cycles, &waited);
+	timing->wait_cycles = waited;
+
+	if (backend == LF_BACKEND_PIO) {
+		for (b = 0; b < out->nbanks; b++) {
+			__raw_writel(out->banks[b].data_mask &
+				~write_masks[b], out->banks[b].base +
+				PIO_OWDR);
+		}
+	}
+	held = sysreg_read(COUNT) - held;
+	if (held > timing->hold_cycles) {
+		timing->hold_cycles = held;
+	}
+}
+
+void ledfloor_write_frame(const struct ledfloor_engine *engine, const struct
+	ledfloor_output *out, uint32_t clk_cycles, uint32_t latch_cycles,
+	unsigned int chunk_cols, struct ledfloor_timing *timing)
+{
+	if (engine->backend == LF_BACKEND_GPIOLIB) {
+		shift_out(engine, out, clk_cycles, latch_cycles, chunk_cols,
+			timing, LF_BACKEND_GPIOLIB);
+	}
+	else {
+		shift_out(engine, out, clk_cycles, latch_cycles, chunk_cols,
+			timing, LF_BACKEND_PIO);
+	}
+}
@@ -0,0 +1,228 @@
+/* Copyright 2010 Benjamin Poirier, benjamin.poirier@gmail.com
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Output engine, the conversion of frames to data port words and the shift
+ * out of those words to the TLC5947 chains. It has no dependency on the rest
+ * of the driver so that it also builds in user space, outside of __KERNEL__,
+ * where the port accesses and the cycle counter are provided by the program
+ * it is linked in, see user/lfsim.
+ */
+#ifndef _LEDFLOOR_ENGINE_H
+#define _LEDFLOOR_ENGINE_H
+
+#ifdef __KERNEL__
+#include <linux/rcupdate.h>
+#include <linux/sched.h>
+#include <linux/types.h>
+
+#define ledfloor_yield() cond_resched()
+
+#ifdef CONFIG_GENERIC_GPIO
+#include <linux/gpio.h>
+#else
+#define gpio_set_value(gpio, value)
+#endif
+
+#ifdef CONFIG_AVR32
+#include <asm/io.h>
+#include <asm/sysreg.h>
+#else
+#include <linux/timex.h>
+
+#define __raw_writel(v, addr)
+#define __raw_readl(addr) 0
+#define sysreg_read(reg) ((uint32_t) get_cycles())
+#define COUNT 0
+#endif
+
+#else
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Provided by the program the engine is linked in */
+void ledfloor_host_writel(uint32_t value, void *addr);
+uint32_t ledfloor_host_readl(void *addr);
+uint32_t ledfloor_host_cycles(void);
+/* Called between the chunks of a frame being clocked out */
+void ledfloor_host_yield(void);
+/* Line writes of LF_BACKEND_GPIOLIB */
+void ledfloor_host_gpio_set(unsigned int gpio, int value);
+
+#define __raw_writel(v, addr) ledfloor_host_writel(v, addr)
+#define __raw_readl(addr) ledfloor_host_readl(addr)
+#define sysreg_read(reg) ledfloor_host_cycles()
+#define COUNT 0
+#define cpu_relax()
+#define ledfloor_yield() ledfloor_host_yield()
+#define gpio_set_value(gpio, value) ledfloor_host_gpio_set(gpio, value)
+#endif
+
+#include "ledfloor.h"
+
+/* Out of arch/avr32/mach-at32ap/pio.h */
+#define PIO_SODR 0x0030 // Set Output Data Register
+#define PIO_CODR 0x0034 // Clear Output Data Register
+#define PIO_ODSR 0x0038 // Output Data Status Register
+#define PIO_OWER 0x00a0 // Output Write Enable Register
+#define PIO_OWDR 0x00a4 // Output Write Disable Register
+#define PIO_OWSR 0x00a8 // Output Write Status Register
+
+#define GPIO_HW_BASE 0xffe02800UL
+/* Registers of port N start at GPIO_HW_BASE + N * GPIO_PORT_SIZE */
+#define GPIO_PORT_SIZE 0x400
+
+/* Number of ports that data lines may be spread over, they are all written
+ * for each clock */
+#define LF_MAXBANKS (LF_MAXROWS / 32)
+
+/* Number of words written to the data ports for the largest frame, one per
+ * bit of each column component and port */
+#define LF_MAXWORDS (LF_MAXCOLS * 3 * 12 * LF_MAXBANKS)
+
+#define GPIO_BANK(N) (N >> 5)
+#define GPIO_INDEX(N) (N % 32)
+
+/* A port that has data lines on it */
+struct ledfloor_bank {
+	void *base;
+	/* Its first line is GPIO number port * 32 */
+	unsigned int port;
+	uint32_t data_mask;
+};
+
+/* How ledfloor_write_frame() drives the lines */
+enum {
+	/* Straight to the PIO registers, all data lines of a port in one
+	 * write */
+	LF_BACKEND_PIO,
+	/* Through the GPIO framework, one call per line that changes, for
+	 * other controllers than the AP7000's */
+	LF_BACKEND_GPIOLIB,
+};
+
+/* Data port values of a frame, in the order in which they are clocked out,
+ * see ledfloor_render() */
+struct ledfloor_output {
+	uint32_t words[LF_MAXWORDS];
+	/* Number of words and ports the words are written to, words holds
+	 * one word per bank for each clock */
+	unsigned int nwords;
+	struct ledfloor_bank banks[LF_MAXBANKS];
+	unsigned int nbanks;
+	/* Hash of words, to spot a frame identical to the one shown */
+	uint32_t hash;
+};
+
+/* Cycle counter ticks measured by ledfloor_write_frame() */
+struct ledfloor_timing {
+	/* From the first clock edge to the last one */
+	uint32_t shift_cycles;
+	unsigned int clocks;
+	/* From the last clock edge to the latch release */
+	uint32_t latch_cycles;
+	/* Spent busy waiting for clock and latch edges */
+	uint32_t wait_cycles;
+	/* Longest stretch without a preemption point */
+	uint32_t hold_cycles;
+	/* Preemption points gone through */
+	unsigned int yields;
+};
+
+/* Look up tables used for the R, G and B components, in the format of
+ * gamma_c */
+struct ledfloor_lut {
+	uint16_t channels[3][256];
+	/* R, G, B values of the LF_FMT_INDEX8 palette */
+	uint8_t palette_rgb[256][3];
+	/* Gain of each calibration class, see LF_IOCSGAINS */
+	uint16_t gains[LF_GAIN_CLASSES];
+	/* Derived from the above by ledfloor_derive_lut() for each class and
+	 * format, so that every component goes through a single look up */
+	uint16_t rgb888[LF_GAIN_CLASSES][3][256];
+	uint16_t palette[LF_GAIN_CLASSES][3][256];
+	uint16_t rgb565[LF_GAIN_CLASSES][3][64];
+	uint16_t rgb444[LF_GAIN_CLASSES][3][16];
+#ifdef __KERNEL__
+	struct rcu_head rcu;
+#endif
+};
+
+/* Wiring and geometry the frames are rendered for, and the lines they are
+ * clocked out on */
+struct ledfloor_engine {
+	/* gather[k][b * 32 + line] = index of the pixel shown by LED k of
+	 * the chain on data line line of port b */
+	uint16_t gather[LF_MAXCOLS][LF_MAXBANKS * 32];
+	/* Whether the components of the LEDs are in B, G, R order */
+	bool bgr;
+	/* classes[k][c][b * 32 + line] = calibration class of component c of
+	 * the pixel gathered for LED k on that line */
+	uint8_t classes[LF_MAXCOLS][3][LF_MAXBANKS * 32];
+	/* Columns that the pixels shown by LED k belong to, one bit each */
+	uint32_t led_columns[LF_MAXCOLS][LF_MAXCOLS / 32];
+	/* Port and line of chain i, b * 32 + line */
+	uint8_t chain_lines[LF_MAXROWS];
+	struct ledfloor_bank banks[LF_MAXBANKS];
+	unsigned int nbanks;
+	/* Groups of 8 data lines used on the ports */
+	unsigned int ngroups;
+	unsigned int rows;
+	unsigned int cols;
+	unsigned int format;
+	void (*render)(const struct ledfloor_engine *engine, const struct
+		ledfloor_lut *lut, const void *pixels, struct ledfloor_output
+		*out);
+
+	unsigned int backend;
+	uint32_t clk_mask, latch_mask;
+	void *clk_reg_set, *clk_reg_clear;
+	void *latch_reg_set, *latch_reg_clear;
+	/* GPIO numbers, for LF_BACKEND_GPIOLIB */
+	int clk, latch;
+};
+
+extern const uint16_t gamma_c[256];
+
+int ledfloor_setup_engine(struct ledfloor_engine *engine, const int *data,
+	unsigned int rows, unsigned int cols, bool rotate, unsigned int
+	format);
+int ledfloor_setup_map(struct ledfloor_engine *engine, const uint16_t *map,
+	uint32_t flags);
+int ledfloor_setup_gains(struct ledfloor_engine *engine, const uint8_t
+	*classes);
+void ledfloor_setup_clock(struct ledfloor_engine *engine, int clk, int
+	latch, unsigned int backend);
+void ledfloor_derive_lut(struct ledfloor_lut *lut);
+void ledfloor_render_columns(const struct ledfloor_engine *engine, const
+	struct ledfloor_lut *lut, const void *pixels, struct ledfloor_output
+	*out, unsigned int col, unsigned int ncols);
+void ledfloor_write_frame(const struct ledfloor_engine *engine, const struct
+	ledfloor_output *out, uint32_t clk_cycles, uint32_t latch_cycles,
+	unsigned int chunk_cols, struct ledfloor_timing *timing);
+int ledfloor_transpose_bench(unsigned long *serial_cycles, unsigned long
+	*parallel_cycles);
+
+/* Fill out with the data port values for pixels, in the current geometry
+ * and format of engine */
+static inline void ledfloor_render(const struct ledfloor_engine *engine,
+	const struct ledfloor_lut *lut, const void *pixels, struct
+	ledfloor_output *out)
+{
+	engine->render(engine, lut, pixels, out);
+}
+
+#endif /* _LEDFLOOR_ENGINE_H */
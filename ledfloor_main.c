@@ -0,0 +1,2557 @@
+/* Copyright 2010 Benjamin Poirier, benjamin.poirier@gmail.com
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <asm/atomic.h>
+#include <asm/uaccess.h>
+#include <linux/bitrev.h>
+#include <linux/cdev.h>
+#include <linux/debugfs.h>
+#include <linux/delay.h>
+#include <linux/init.h>
+#include <linux/fs.h>
+#include <linux/hrtimer.h>
+#include <linux/kref.h>
+#include <linux/kthread.h>
+#include <linux/math64.h>
+#include <linux/mm.h>
+#include <linux/module.h>
+#include <linux/moduleparam.h>
+#include <linux/mutex.h>
+#include <linux/platform_device.h>
+#include <linux/poll.h>
+#include <linux/rcupdate.h>
+#include <linux/seq_file.h>
+#include <linux/slab.h>
+#include <linux/sched.h>
+#include <linux/spinlock.h>
+#include <linux/stringify.h>
+#include <linux/vmalloc.h>
+#include <linux/wait.h>
+
+#include "ledfloor.h"
+#include "ledfloor_engine.h"
+
+#define CREATE_TRACE_POINTS
+#include "ledfloor_trace.h"
+
+#ifdef CONFIG_AVR32
+#include <mach/at32ap700x.h>
+#else
+/* Out of arch/avr32/mach-at32ap/include/mach/at32ap700x.h */
+#define GPIO_PIOA_BASE	(0)
+#define GPIO_PIOB_BASE	(GPIO_PIOA_BASE + 32)
+#define GPIO_PIOC_BASE	(GPIO_PIOB_BASE + 32)
+#define GPIO_PIOD_BASE	(GPIO_PIOC_BASE + 32)
+#define GPIO_PIOE_BASE	(GPIO_PIOD_BASE + 32)
+
+#define GPIO_PIN_PA(N)	(GPIO_PIOA_BASE + (N))
+#define GPIO_PIN_PB(N)	(GPIO_PIOB_BASE + (N))
+#define GPIO_PIN_PC(N)	(GPIO_PIOC_BASE + (N))
+#define GPIO_PIN_PD(N)	(GPIO_PIOD_BASE + (N))
+#define GPIO_PIN_PE(N)	(GPIO_PIOE_BASE + (N))
+
+#endif
+
+/* gpio_set_value() comes along with the output engine */
+#ifndef CONFIG_GENERIC_GPIO
+#define gpio_request(gpio, label) 0
+#define gpio_free(gpio) do { } while (0)
+#define gpio_direction_output(gpio, value) 0
+#define gpio_cansleep(gpio) 0
+#endif
+
+static unsigned int frame_interval_us;
+module_param(frame_interval_us, uint, S_IRUGO);
+MODULE_PARM_DESC(frame_interval_us, "Minimum time between the start of two "
+	"frames, in microseconds, frames posted faster than that are coalesced");
+
+static unsigned int chunk_cols = 8;
+module_param(chunk_cols, uint, S_IRUGO);
+MODULE_PARM_DESC(chunk_cols, "Number of columns clocked out between two "
+	"preemption points, 0 for a whole frame at once, at most "
+	__stringify(LF_MAXCOLS) " (default 8)");
+
+/* The default lines are those of the AP7000 board, they mean nothing on
+ * another controller. gpiolib then has to be asked for along with every
+ * line, without it no line is driven but on avr32. */
+static int gpiolib;
+module_param(gpiolib, bool, S_IRUGO);
+MODULE_PARM_DESC(gpiolib, "Write the lines through the GPIO framework "
+	"rather than straight to the PIO registers, for other GPIO "
+	"controllers, data_pins, clk_pin, latch_pin and blank_pin must be "
+	"given");
+
+static int clk_pin = -1;
+module_param(clk_pin, int, S_IRUGO);
+MODULE_PARM_DESC(clk_pin, "GPIO number of the clock line");
+
+static int latch_pin = -1;
+module_param(latch_pin, int, S_IRUGO);
+MODULE_PARM_DESC(latch_pin, "GPIO number of the latch line");
+
+static int blank_pin = -1;
+module_param(blank_pin, int, S_IRUGO);
+MODULE_PARM_DESC(blank_pin, "GPIO number of the blank line");
+
+#ifdef CONFIG_AVR32
+static int activity_led = GPIO_PIN_PE(19);
+#else
+static int activity_led = -1;
+#endif
+module_param(activity_led, int, S_IRUGO);
+MODULE_PARM_DESC(activity_led, "GPIO number of an active low LED lit while "
+	"a frame is clocked out, -1 for none (default PE19 on avr32, none "
+	"elsewhere)");
+
+static unsigned int rows;
+module_param(rows, uint, S_IRUGO);
+MODULE_PARM_DESC(rows, "Number of rows of the floor (default "
+	__stringify(LFROWS) ")");
+
+static int data_pins[LF_MAXROWS];
+static unsigned int nr_data_pins;
+module_param_array(data_pins, int, &nr_data_pins, S_IRUGO);
+MODULE_PARM_DESC(data_pins, "GPIO number of the data line of each row, they "
+	"may be on up to " __stringify(LF_MAXBANKS) " ports");
+
+static unsigned int cols;
+module_param(cols, uint, S_IRUGO);
+MODULE_PARM_DESC(cols, "Number of columns of the floors (default "
+	__stringify(LFCOLS) ")");
+
+/* A second floor is driven by ledfloor1 when its lines are given. Unless
+ * with gpiolib, its data lines may not be on a port that the first floor has
+ * data lines on. */
+static int data_pins1[LF_MAXROWS];
+static unsigned int nr_data_pins1;
+module_param_array(data_pins1, int, &nr_data_pins1, S_IRUGO);
+MODULE_PARM_DESC(data_pins1, "GPIO number of the data line of each row of "
+	"a second floor, one row per line");
+
+static int clk_pin1 = -1;
+module_param(clk_pin1, int, S_IRUGO);
+MODULE_PARM_DESC(clk_pin1, "GPIO number of the clock line of the second "
+	"floor");
+
+static int latch_pin1 = -1;
+module_param(latch_pin1, int, S_IRUGO);
+MODULE_PARM_DESC(latch_pin1, "GPIO number of the latch line of the second "
+	"floor");
+
+static int blank_pin1 = -1;
+module_param(blank_pin1, int, S_IRUGO);
+MODULE_PARM_DESC(blank_pin1, "GPIO number of the blank line of the second "
+	"floor");
+
+/* The ring is allocated at probe for frames of the largest geometry and
+ * format, whether LF_IOCQUEUE is used or not */
+static unsigned int queue_len;
+module_param(queue_len, uint, S_IRUGO);
+MODULE_PARM_DESC(queue_len, "Number of frames that can be queued with "
+	"LF_IOCQUEUE, per floor, 0 to disable it (default 0)");
+
+/* Floors driven by the module, one minor each */
+#define LEDFLOOR_MAXDEVS 2
+
+static struct platform_device *ledfloor_gpio_devices[LEDFLOOR_MAXDEVS];
+static struct class *ledfloor_class;
+/* First of the LEDFLOOR_MAXDEVS minors */
+static dev_t ledfloor_devid;
+/* A frame as written to the device and its conversion to data port values,
+ * see render_frame() */
+struct ledfloor_frame {
+	/* Points into slot_area */
+	uint8_t *pixels;
+	/* Port words and size of pixels, set by render_frame() for the
+	 * geometry at that time */
+	struct ledfloor_output out;
+	size_t size;
+	/* Value of render_gen when words were rendered */
+	unsigned int render_gen;
+	/* Presentation time of a queued frame, when its latch is due */
+	ktime_t pts;
+	/* Value of fnum once this frame has been clocked out */
+	unsigned int fnum;
+};
+
+/* Histogram of durations in ns with log2 buckets, bucket n counts the
+ * values v such that fls(v) == n, that is 2^(n-1) <= v < 2^n. Exposed in
+ * debugfs, see hist_show().
+ */
+#define LF_HIST_BUCKETS 33
+struct ledfloor_hist {
+	const char *name;
+	spinlock_t lock;
+	unsigned long count;
+	unsigned long min;
+	unsigned long max;
+	unsigned long buckets[LF_HIST_BUCKETS];
+};
+
+enum {
+	LF_HIST_SHIFTOUT,
+	LF_HIST_INTERVAL,
+	LF_HIST_COPY,
+	LF_HIST_WAIT,
+	LF_HIST_LATENESS,
+	LF_HIST_HOLD,
+	LF_HIST_NB,
+};
+
+static const char *hist_names[LF_HIST_NB] = {
+	[LF_HIST_SHIFTOUT] = "shiftout_ns",
+	[LF_HIST_INTERVAL] = "frame_interval_ns",
+	[LF_HIST_COPY] = "copy_from_user_ns",
+	[LF_HIST_WAIT] = "edge_wait_ns",
+	[LF_HIST_LATENESS] = "queue_lateness_ns",
+	[LF_HIST_HOLD] = "cpu_hold_ns",
+};
+
+/* One floor, everything it uses is here so that floors are refreshed
+ * independently, each by its own output thread. */
+struct ledfloor_dev_t {
+	/* Minor number and platform device id */
+	int id;
+	/* Held by the platform device and by each open file, the floor is
+	 * freed by free_floor() once it is removed and its files closed */
+	struct kref kref;
+	/* Set on remove, files still open then only get -ENODEV */
+	bool removed;
+	/* Copy of the platform data, changed by the ioctls */
+	struct ledfloor_config *config;
+
+	/* Wiring and geometry the frames are rendered for, see
+	 * setup_geometry() */
+	struct ledfloor_engine engine;
+	/* Look up tables used for the R, G and B components. The renderer
+	 * picks up luts once per frame under rcu_read_lock(), a new set is
+	 * built aside and published with set_luts(). */
+	struct ledfloor_lut default_lut;
+	struct ledfloor_lut *luts;
+	/* Changed along with anything that render_frame() depends on but
+	 * the pixels, words rendered under different ones can't be mixed */
+	unsigned int render_gen;
+
+	/* Triple buffered frame store. back is filled by ledfloor_write(),
+	 * front is being clocked out by the output thread and pending is the
+	 * latest complete frame waiting to be picked up, if pending_fresh.
+	 * Only the pointers are exchanged, under lock, so the output thread
+	 * reads front without holding anything.
+	 */
+	struct ledfloor_frame frames[LF_SLOTS];
+	struct ledfloor_frame *back, *pending, *front;
+	/* Pixels of the frames, one page aligned slot per frame so that
+	 * producers can mmap() them */
+	void *slot_area;
+	bool pending_fresh;
+	/* back does not hold the last frame posted, see stage_frame() */
+	bool back_stale;
+	/* The output thread is clocking out front */
+	bool output_busy;
+	/* Frames replaced in pending before being clocked out */
+	unsigned long frames_coalesced;
+	/* Frames identical to the one shown, that were not clocked out */
+	unsigned long frames_elided;
+	/* Frame clocked out last, front or a queued frame */
+	struct ledfloor_frame *shown;
+
+	/* Frames queued with LF_IOCQUEUE, rendered in advance and clocked
+	 * out at their pts. queue_count frames from queue[queue_head] on, in
+	 * a ring of queue_len + 1 frames so that the one before
+	 * queue_head, which may be shown, is never filled again while
+	 * queue_count < queue_len. */
+	struct ledfloor_frame *queue;
+	void *queue_pixels;
+	unsigned int queue_head, queue_count;
+	/* Latched more than QUEUE_LATE_NS after their pts */
+	unsigned long frames_late;
+	/* Dropped because the next queued frame was due too */
+	unsigned long frames_skipped;
+	spinlock_t lock;
+	struct mutex write_lock;
+	struct task_struct *output_thread;
+	wait_queue_head_t output_wq;
+
+	/* Frame rate governor, the output thread does not start a frame
+	 * before next_start, it is woken up by governor_timer */
+	unsigned int frame_interval_us;
+	ktime_t next_start;
+	/* Columns clocked out between two preemption points, see
+	 * ledfloor_write_frame() */
+	unsigned int chunk_cols;
+	struct hrtimer governor_timer;
+
+	/* Output statistics, updated under lock */
+	ktime_t last_shown;
+	unsigned long avg_interval_ns;
+	unsigned long max_shiftout_ns;
+	/* Longest time the output thread held the CPU during a shift out */
+	unsigned long max_hold_ns;
+	unsigned long last_shiftout_ns;
+	struct ledfloor_timing timing;
+	struct ledfloor_hist hists[LF_HIST_NB];
+	struct dentry *debugfs_dir;
+
+	dev_t devid;
+	struct cdev cdev;
+	struct device *device;
+	/* Woken up when pending is picked up and when a frame has been
+	 * clocked out */
+	wait_queue_head_t wq;
+	atomic_t fnum;
+};
+
+/* Average over the last 8 frames or so */
+#define INTERVAL_EWMA_SHIFT 3
+/* Beyond timer and scheduling latencies */
+#define QUEUE_LATE_NS (500 * NSEC_PER_USEC)
+
+/* Per open file state. Readers copy the front frame to snapshot when they
+ * start reading a frame so that they always get a complete one.
+ */
+struct ledfloor_file_t {
+	struct ledfloor_dev_t *dev;
+	uint8_t snapshot[LF_MAX_FRAME_SIZE];
+	size_t snapshot_size;
+	unsigned int snapshot_fnum;
+};
+static struct ledfloor_config
+{
+	int blank;
+	int latch;
+	int clk;
+	/* Lit while a frame is clocked out, -1 for none */
+	int activity_led;
+	/* Only the first data_lines are wired, on up to LF_MAXBANKS ports */
+	int data[LF_MAXROWS];
+	unsigned int data_lines;
+	unsigned int rows;
+	unsigned int cols;
+	bool rotate; // 180 degrees rotation at no extra cost
+	/* Layout set with LF_IOCSMAP, rows * cols pixel indexes, NULL for the
+	 * one given by rotate */
+	uint16_t *map;
+	uint32_t map_flags;
+	/* Calibration classes set with LF_IOCSGAINS, rows * cols * 3, NULL for
+	 * class 0 everywhere */
+	uint8_t *gain_classes;
+	unsigned int format;
+	uint32_t latch_ndelay;
+	uint32_t clk_ndelay;
+	/* The delays above in cycle counter ticks, see set_delays() */
+	uint32_t latch_cycles;
+	uint32_t clk_cycles;
+} ledfloor_config_data = {
+	.blank = GPIO_PIN_PA(29),
+	.latch = GPIO_PIN_PA(30),
+	.clk = GPIO_PIN_PA(31),
+	.activity_led = -1,
+	.data = {
+		GPIO_PIN_PB(4),
+		GPIO_PIN_PB(3),
+		GPIO_PIN_PB(0),
+		GPIO_PIN_PB(5),
+		GPIO_PIN_PB(2),
+		GPIO_PIN_PB(1),
+		GPIO_PIN_PB(16),
+		GPIO_PIN_PB(15),
+		GPIO_PIN_PB(12),
+		GPIO_PIN_PB(17),
+		GPIO_PIN_PB(14),
+		GPIO_PIN_PB(13),
+		GPIO_PIN_PB(11),
+		GPIO_PIN_PB(6),
+		GPIO_PIN_PB(7),
+		GPIO_PIN_PB(10),
+		GPIO_PIN_PB(9),
+		GPIO_PIN_PB(8),
+		GPIO_PIN_PB(19),
+		GPIO_PIN_PB(18),
+		GPIO_PIN_PB(21),
+		GPIO_PIN_PB(20),
+		GPIO_PIN_PB(23),
+		GPIO_PIN_PB(22),
+	},
+	.data_lines = 24,
+	.rows = LFROWS,
+	.cols = LFCOLS,
+	.rotate = false,
+	.format = LF_FMT_RGB888,
+	.latch_ndelay = 2000,
+	.clk_ndelay = 2000,
+};
+/* Instances, to check that floors don't share data ports. Probe and
+ * remove are serialized by ledfloor_devs_lock. */
+static struct ledfloor_dev_t *ledfloor_devs[LEDFLOOR_MAXDEVS];
+static DEFINE_MUTEX(ledfloor_devs_lock);
+/* Cycle counter frequency, see calibrate_cycles(). A property of the CPU,
+ * shared by all floors. */
+static unsigned long cycles_khz;
+
+/* Request gpio and drive it high */
+static int __init gpio_output(unsigned int gpio, const char *label)
+{
+	int errno;
+
+	if ((errno = gpio_request(gpio, label))) {
+		return errno;
+	}
+	if ((errno = gpio_direction_output(gpio, 1))) {
+		gpio_free(gpio);
+	}
+
+	return errno;
+}
+
+/* The next functions access GPIO registers directly to bypass many function
+ * call levels and, more importantly, write many bits at once on one port.
+ * This is sketchy because it bypasses the whole gpio framework, but it's way
+ * faster. The addresses and register offsets were obtained by looking at the
+ * PIO driver and confirmed with the AP7000 datasheet.
+ */
+static int __init gpio_init(struct ledfloor_dev_t *dev)
+{
+	const struct ledfloor_config *config = dev->config;
+	unsigned int i;
+	int errno;
+
+#ifndef CONFIG_AVR32
+	/* The PIO backend writes nowhere, the lines of the AP7000 board
+	 * are not to be touched on this machine */
+	if (!gpiolib) {
+		ledfloor_setup_clock(&dev->engine, config->clk, config->latch,
+			LF_BACKEND_PIO);
+		return 0;
+	}
+#endif
+
+	/* The lines are written with the output thread busy waiting on the
+	 * clock edges, they can't be behind a bus that sleeps */
+	if (gpiolib) {
+		if (gpio_cansleep(config->clk) ||
+			gpio_cansleep(config->latch)) {
+			printk(KERN_ERR "ledfloor gpio_init, clock and latch "
+				"lines can't be on a controller that "
+				"sleeps\n");
+			return -EINVAL;
+		}
+		for (i = 0; i < config->data_lines; i++) {
+			if (gpio_cansleep(config->data[i])) {
+				printk(KERN_ERR "ledfloor gpio_init, data "
+					"line %d can't be on a controller "
+					"that sleeps\n", i);
+				return -EINVAL;
+			}
+		}
+	}
+
+	if ((errno = gpio_output(config->blank, "ledfloor blank"))) {
+		printk(KERN_ERR "ledfloor gpio_init, failed to "
+			"register blank line\n");
+		return errno;
+	}
+	if ((errno = gpio_output(config->latch, "ledfloor latch"))) {
+		printk(KERN_ERR "ledfloor gpio_init, failed to "
+			"register latch line\n");
+		goto fail_latch;
+	}
+	if ((errno = gpio_output(config->clk, "ledfloor clock"))) {
+		printk(KERN_ERR "ledfloor gpio_init, failed to "
+			"register clock line\n");
+		goto fail_clk;
+	}
+
+	for (i = 0; i < config->data_lines; i++)
+	{
+		if ((errno = gpio_output(config->data[i], "ledfloor data"))) {
+			printk(KERN_ERR "ledfloor gpio_init, failed to "
+				"register data line %d\n", i);
+			goto fail_data;
+		}
+	}
+
+	if (!gpiolib) {
+		ledfloor_setup_clock(&dev->engine, config->clk, config->latch,
+			LF_BACKEND_PIO);
+		return 0;
+	}
+
+	/* Off, the LED is active low. On the board, it is set up by the
+	 * platform code. */
+	if (config->activity_led >= 0 &&
+		(errno = gpio_output(config->activity_led,
+			"ledfloor activity"))) {
+		printk(KERN_ERR "ledfloor gpio_init, failed to "
+			"register activity LED\n");
+		goto fail_data;
+	}
+	ledfloor_setup_clock(&dev->engine, config->clk, config->latch,
+		LF_BACKEND_GPIOLIB);
+
+	return 0;
+
+fail_data:
+	while (i--) {
+		gpio_free(config->data[i]);
+	}
+	gpio_free(config->clk);
+fail_clk:
+	gpio_free(config->latch);
+fail_latch:
+	gpio_free(config->blank);
+	return errno;
+}
+
+/* Release the lines requested by gpio_init() */
+static void gpio_exit(struct ledfloor_dev_t *dev)
+{
+	const struct ledfloor_config *config = dev->config;
+	unsigned int i;
+
+#ifndef CONFIG_AVR32
+	if (!gpiolib) {
+		return;
+	}
+#endif
+
+	if (gpiolib && config->activity_led >= 0) {
+		gpio_free(config->activity_led);
+	}
+	for (i = 0; i < config->data_lines; i++) {
+		gpio_free(config->data[i]);
+	}
+	gpio_free(config->clk);
+	gpio_free(config->latch);
+	gpio_free(config->blank);
+}
+
+/* Check the word-parallel transpose against the bit by bit one and report
+ * how many cycles each one takes to convert a frame worth of column
+ * components.
+ */
+static int __init transpose_bench(void)
+{
+	unsigned long serial_cycles, parallel_cycles;
+
+	if (ledfloor_transpose_bench(&serial_cycles, &parallel_cycles)) {
+		printk(KERN_ERR "ledfloor transpose mismatch\n");
+		return -EIO;
+	}
+
+	printk(KERN_INFO "ledfloor transpose, cycles per frame: serial %lu, "
+		"word-parallel %lu\n", serial_cycles, parallel_cycles);
+
+	return 0;
+}
+
+/* Fill frame->out with the data port values for frame->pixels, all of the
+ * frame going through the same tables */
+static void render_frame(struct ledfloor_dev_t *dev, struct
+	ledfloor_frame *frame)
+{
+	const struct ledfloor_config *config = dev->config;
+
+	rcu_read_lock();
+	ledfloor_render(&dev->engine, rcu_dereference(dev->luts),
+		frame->pixels, &frame->out);
+	rcu_read_unlock();
+	frame->render_gen = dev->render_gen;
+	frame->size = LF_FRAME_SIZE(config->rows, config->cols,
+		config->format);
+}
+
+/* Render again the columns col to col + ncols - 1 of a frame rendered with
+ * the current geometry, format and look up tables */
+static void render_columns(struct ledfloor_dev_t *dev, struct
+	ledfloor_frame *frame, const unsigned int col, const unsigned int
+	ncols)
+{
+	rcu_read_lock();
+	ledfloor_render_columns(&dev->engine, rcu_dereference(dev->luts),
+		frame->pixels, &frame->out, col, ncols);
+	rcu_read_unlock();
+}
+
+static void free_lut(struct rcu_head *head)
+{
+	kfree(container_of(head, struct ledfloor_lut, rcu));
+}
+
+/* Frames rendered from now on use lut. The one it replaces is freed once
+ * no frame being rendered can be using it anymore. Called under
+ * dev->write_lock.
+ */
+static void set_luts(struct ledfloor_dev_t *dev, struct ledfloor_lut *lut)
+{
+	struct ledfloor_lut *old = dev->luts;
+
+	rcu_assign_pointer(dev->luts, lut);
+	dev->render_gen++;
+	if (old != &dev->default_lut) {
+		call_rcu(&old->rcu, free_lut);
+	}
+}
+
+/* Free the tables in use when the floor goes away. Those replaced before
+ * by set_luts() are waited for with rcu_barrier() in ledfloor_exit(), so
+ * that free_lut() never runs once the module is gone.
+ */
+static void free_luts(struct ledfloor_dev_t *dev)
+{
+	/* Frames rendered before may still hold the last tables */
+	synchronize_rcu();
+	if (dev->luts != &dev->default_lut) {
+		kfree(dev->luts);
+	}
+	dev->luts = &dev->default_lut;
+}
+
+/* Derive the conversion tables and the ports to write from the geometry and
+ * the wiring, see ledfloor_setup_engine() */
+static int setup_geometry(struct ledfloor_dev_t *dev)
+{
+	const struct ledfloor_config *config = dev->config;
+	int ret;
+
+	ret = ledfloor_setup_engine(&dev->engine, config->data, config->rows,
+		config->cols, config->rotate, config->format);
+	if (ret < 0) {
+		return ret;
+	}
+	dev->render_gen++;
+	if (config->map) {
+		ret = ledfloor_setup_map(&dev->engine, config->map,
+			config->map_flags);
+		if (ret < 0) {
+			return ret;
+		}
+	}
+	if (config->gain_classes) {
+		ret = ledfloor_setup_gains(&dev->engine,
+			config->gain_classes);
+		if (ret < 0) {
+			return ret;
+		}
+	}
+
+	return 0;
+}
+
+static int set_geometry(struct ledfloor_dev_t *dev, const unsigned int
+	rows, const unsigned int cols)
+{
+	struct ledfloor_config *config = dev->config;
+	unsigned int old_rows = config->rows, old_cols = config->cols;
+	uint16_t *old_map;
+	uint8_t *old_classes;
+	int ret;
+
+	if (rows < 1 || rows > config->data_lines || cols < 1 || cols >
+		LF_MAXCOLS) {
+		return -EINVAL;
+	}
+
+	config->rows = rows;
+	config->cols = cols;
+	old_map = config->map;
+	config->map = NULL;
+	old_classes = config->gain_classes;
+	config->gain_classes = NULL;
+	ret = setup_geometry(dev);
+	if (ret < 0) {
+		config->rows = old_rows;
+		config->cols = old_cols;
+		config->map = old_map;
+		config->gain_classes = old_classes;
+		/* The engine may be half set up for the new geometry */
+		setup_geometry(dev);
+		return ret;
+	}
+	kfree(old_map);
+	kfree(old_classes);
+
+	return 0;
+}
+
+/* LF_IOCSMAP, pixels is checked against the current geometry by
+ * ledfloor_setup_map() */
+static int set_map(struct ledfloor_dev_t *dev, const struct lf_map *map)
+{
+	struct ledfloor_config *config = dev->config;
+	const size_t size = config->rows * config->cols * sizeof(*config->map);
+	uint16_t *pixels = NULL;
+	int ret;
+
+	if (map->flags & ~LF_MAP_BGR) {
+		return -EINVAL;
+	}
+
+	if (map->pixels) {
+		pixels = kmalloc(size, GFP_KERNEL);
+		if (!pixels) {
+			return -ENOMEM;
+		}
+		if (copy_from_user(pixels, (const uint16_t __user *)
+				map->pixels, size)) {
+			kfree(pixels);
+			return -EFAULT;
+		}
+		ret = ledfloor_setup_map(&dev->engine, pixels, map->flags);
+		if (ret < 0) {
+			kfree(pixels);
+			return ret;
+		}
+	}
+
+	kfree(config->map);
+	config->map = pixels;
+	config->map_flags = map->flags;
+
+	return setup_geometry(dev);
+}
+
+/* LF_IOCSGAINS, the gains go in a new set of look up tables derived from
+ * the current one and the classes in the engine, both used from the next
+ * frame rendered on. Called under dev->write_lock.
+ */
+static int set_gains(struct ledfloor_dev_t *dev, const struct lf_gains
+	*gains)
+{
+	struct ledfloor_config *config = dev->config;
+	const size_t size = config->rows * config->cols * 3;
+	uint8_t *classes = NULL, *old_classes;
+	struct ledfloor_lut *lut;
+	int ret;
+
+	lut = kmalloc(sizeof(*lut), GFP_KERNEL);
+	if (!lut) {
+		return -ENOMEM;
+	}
+
+	if (gains->classes) {
+		classes = kmalloc(size, GFP_KERNEL);
+		if (!classes) {
+			kfree(lut);
+			return -ENOMEM;
+		}
+		if (copy_from_user(classes, (const uint8_t __user *)
+				gains->classes, size)) {
+			ret = -EFAULT;
+			goto fail;
+		}
+	}
+
+	/* The classes are checked by ledfloor_setup_gains() in
+	 * setup_geometry(), the old ones are kept until that succeeds */
+	old_classes = config->gain_classes;
+	config->gain_classes = classes;
+	ret = setup_geometry(dev);
+	if (ret < 0) {
+		config->gain_classes = old_classes;
+		setup_geometry(dev);
+		goto fail;
+	}
+	kfree(old_classes);
+
+	memcpy(lut->channels, dev->luts->channels, sizeof(lut->channels));
+	memcpy(lut->palette_rgb, dev->luts->palette_rgb,
+		sizeof(lut->palette_rgb));
+	memcpy(lut->gains, gains->gains, sizeof(lut->gains));
+	ledfloor_derive_lut(lut);
+	set_luts(dev, lut);
+
+	return 0;
+
+fail:
+	kfree(classes);
+	kfree(lut);
+	return ret;
+}
+
+static int set_format(struct ledfloor_dev_t *dev, const unsigned int
+	format)
+{
+	if (format >= LF_FMT_NB) {
+		return -EINVAL;
+	}
+
+	dev->config->format = format;
+
+	return setup_geometry(dev);
+}
+
+/* Measure the cycle counter frequency against the clock source */
+static void __init calibrate_cycles(void)
+{
+	ktime_t start;
+	uint32_t cycles;
+	s64 ns;
+
+	start = ktime_get();
+	cycles = sysreg_read(COUNT);
+	mdelay(10);
+	cycles = sysreg_read(COUNT) - cycles;
+	ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+
+	cycles_khz = div_u64((u64) cycles * NSEC_PER_MSEC, ns);
+	printk(KERN_INFO "ledfloor cycle counter at %lu kHz\n", cycles_khz);
+}
+
+/* Rounded up, so that the delays are never shorter than asked for */
+static uint32_t ns_to_cycles(uint32_t ns)
+{
+	return div_u64((u64) ns * cycles_khz + NSEC_PER_MSEC - 1,
+		NSEC_PER_MSEC);
+}
+
+/* Average duration of n periods lasting cycles in total */
+static uint32_t cycles_to_ns(uint32_t cycles, unsigned int n)
+{
+	if (!cycles_khz) {
+		return 0;
+	}
+
+	/* Beyond 32 bits for a whole frame of clocks at GHz rates */
+	return div64_u64((u64) cycles * NSEC_PER_MSEC, (u64) cycles_khz * n);
+}
+
+static void set_delays(struct ledfloor_config *config)
+{
+	config->latch_cycles = ns_to_cycles(config->latch_ndelay);
+	config->clk_cycles = ns_to_cycles(config->clk_ndelay);
+}
+
+static void hist_add(struct ledfloor_hist *hist, uint32_t ns)
+{
+	spin_lock(&hist->lock);
+	if (!hist->count || ns < hist->min) {
+		hist->min = ns;
+	}
+	if (ns > hist->max) {
+		hist->max = ns;
+	}
+	hist->count++;
+	hist->buckets[fls(ns)]++;
+	spin_unlock(&hist->lock);
+}
+
+static void hist_reset(struct ledfloor_hist *hist)
+{
+	spin_lock(&hist->lock);
+	hist->count = 0;
+	hist->min = 0;
+	hist->max = 0;
+	memset(hist->buckets, 0, sizeof(hist->buckets));
+	spin_unlock(&hist->lock);
+}
+
+/* Whether frame number n has been clocked out */
+static inline bool frame_shown(struct ledfloor_dev_t *dev, unsigned int n)
+{
+	return (int) (atomic_read(&dev->fnum) - n) >= 0;
+}
+
+/* Whether every frame posted has been clocked out or dropped */
+static bool output_idle(struct ledfloor_dev_t *dev)
+{
+	bool idle;
+
+	spin_lock(&dev->lock);
+	idle = !dev->pending_fresh && !dev->output_busy && !dev->queue_count;
+	spin_unlock(&dev->lock);
+
+	return idle;
+}
+
+/* Hand the back frame, already rendered, over to the output thread. If the
+ * previous frame has not been picked up yet, it is replaced and counted as
+ * dropped.
+ */
+static void post_frame(struct ledfloor_dev_t *dev)
+{
+	spin_lock(&dev->lock);
+	trace_ledfloor_frame_complete(dev->back - dev->frames,
+		dev->pending_fresh);
+	swap(dev->back, dev->pending);
+	if (dev->pending_fresh) {
+		dev->frames_coalesced++;
+	}
+	dev->pending_fresh = true;
+	dev->back_stale = true;
+	spin_unlock(&dev->lock);
+
+	wake_up(&dev->output_wq);
+}
+
+static enum hrtimer_restart governor_timer_fn(struct hrtimer *timer)
+{
+	struct ledfloor_dev_t *dev = container_of(timer, struct
+		ledfloor_dev_t, governor_timer);
+
+	wake_up(&dev->output_wq);
+
+	return HRTIMER_NORESTART;
+}
+
+/* When the shift-out of a queued frame should start for it to be latched
+ * at its pts, assuming it takes as long as the previous one */
+static inline ktime_t queue_start(struct ledfloor_dev_t *dev, const struct
+	ledfloor_frame *frame)
+{
+	return ktime_sub_ns(frame->pts, dev->last_shiftout_ns);
+}
+
+/* Whether the output thread has a frame to clock out now. If not, the
+ * governor timer is armed to wake the thread up when the next queued frame
+ * is due or when the frame rate governor lets the pending frame through.
+ */
+static bool output_ready(struct ledfloor_dev_t *dev)
+{
+	ktime_t now = ktime_get(), wakeup;
+	bool wait = false;
+
+	if (dev->queue_count) {
+		wakeup = queue_start(dev, &dev->queue[dev->queue_head]);
+		if (ktime_to_ns(ktime_sub(wakeup, now)) <= 0) {
+			return true;
+		}
+		wait = true;
+	}
+	if (dev->pending_fresh) {
+		if (ktime_to_ns(ktime_sub(dev->next_start, now)) <= 0) {
+			return true;
+		}
+		if (!wait || ktime_to_ns(ktime_sub(dev->next_start, wakeup)) <
+			0) {
+			wakeup = dev->next_start;
+		}
+		wait = true;
+	}
+
+	if (wait) {
+		hrtimer_start(&dev->governor_timer, wakeup, HRTIMER_MODE_ABS);
+	}
+	return false;
+}
+
+/* Take the next frame to clock out, under dev->lock. That is the last
+ * queued frame that is due, the ones before it are skipped, or else the
+ * pending one if the governor lets it through. NULL if none is ready.
+ */
+static struct ledfloor_frame *next_frame(struct ledfloor_dev_t *dev, ktime_t
+	now)
+{
+	const unsigned int ring_len = queue_len + 1;
+	struct ledfloor_frame *frame;
+
+	if (dev->queue_count && ktime_to_ns(ktime_sub(queue_start(dev,
+					&dev->queue[dev->queue_head]), now)) <=
+		0) {
+		while (dev->queue_count > 1 && ktime_to_ns(ktime_sub(
+					queue_start(dev, &dev->queue[
+						(dev->queue_head + 1) %
+						ring_len]), now)) <= 0) {
+			dev->queue_head = (dev->queue_head + 1) % ring_len;
+			dev->queue_count--;
+			dev->frames_skipped++;
+		}
+		frame = &dev->queue[dev->queue_head];
+		dev->queue_head = (dev->queue_head + 1) % ring_len;
+		dev->queue_count--;
+
+		return frame;
+	}
+
+	if (dev->pending_fresh && ktime_to_ns(ktime_sub(dev->next_start,
+				now)) <= 0) {
+		swap(dev->pending, dev->front);
+		dev->pending_fresh = false;
+
+		return dev->front;
+	}
+
+	return NULL;
+}
+
+static void account_frame(struct ledfloor_dev_t *dev, ktime_t start, ktime_t
+	end)
+{
+	unsigned long shiftout_ns = ktime_to_ns(ktime_sub(end, start));
+	s64 interval_ns = ktime_to_ns(ktime_sub(end, dev->last_shown));
+
+	if (shiftout_ns > dev->max_shiftout_ns) {
+		dev->max_shiftout_ns = shiftout_ns;
+	}
+	dev->last_shiftout_ns = shiftout_ns;
+	hist_add(&dev->hists[LF_HIST_SHIFTOUT], shiftout_ns);
+	if (ktime_to_ns(dev->last_shown)) {
+		hist_add(&dev->hists[LF_HIST_INTERVAL], min_t(s64, interval_ns,
+				UINT_MAX));
+	}
+	/* Restart the average after the first frame or a pause */
+	if (!ktime_to_ns(dev->last_shown) || interval_ns >= NSEC_PER_SEC) {
+		dev->avg_interval_ns = 0;
+	}
+	else if (dev->avg_interval_ns) {
+		dev->avg_interval_ns += (long) (interval_ns -
+			dev->avg_interval_ns) >> INTERVAL_EWMA_SHIFT;
+	}
+	else {
+		dev->avg_interval_ns = interval_ns;
+	}
+	dev->last_shown = end;
+}
+
+/* The output thread owns the GPIO lines, it clocks out the latest frame
+ * posted so that writers never wait on data transmission.
+ */
+static int output_thread(void *data)
+{
+	struct ledfloor_dev_t *dev = data;
+	struct ledfloor_frame *frame, *shown;
+	ktime_t start, end;
+	struct ledfloor_timing timing;
+	bool elide, queued;
+	s64 lateness_ns;
+	unsigned long hold_ns;
+
+	while (true) {
+		wait_event_interruptible(dev->output_wq, output_ready(dev) ||
+			kthread_should_stop());
+		if (kthread_should_stop()) {
+			break;
+		}
+
+		spin_lock(&dev->lock);
+		frame = next_frame(dev, ktime_get());
+		if (!frame) {
+			spin_unlock(&dev->lock);
+			continue;
+		}
+		queued = frame != dev->front;
+		/* The floor already shows that frame, only the case of a
+		 * static image pays for the memcmp() */
+		shown = dev->shown;
+		elide = atomic_read(&dev->fnum) && frame->out.hash ==
+			shown->out.hash && frame->out.nwords ==
+			shown->out.nwords && !memcmp(frame->out.banks,
+				shown->out.banks, sizeof(shown->out.banks)) &&
+			!memcmp(frame->out.words, shown->out.words,
+				shown->out.nwords * sizeof(*shown->out.words));
+		dev->shown = frame;
+		frame->fnum = atomic_read(&dev->fnum) + 1;
+		if (elide) {
+			trace_ledfloor_frame_elided(frame->fnum);
+			dev->frames_elided++;
+			atomic_inc(&dev->fnum);
+			spin_unlock(&dev->lock);
+			wake_up_interruptible(&dev->wq);
+			continue;
+		}
+		dev->output_busy = true;
+		spin_unlock(&dev->lock);
+		wake_up_interruptible(&dev->wq);
+
+		start = ktime_get();
+		dev->next_start = ktime_add_us(start, dev->frame_interval_us);
+		trace_ledfloor_shiftout_begin(frame->fnum, frame->out.nwords);
+		// LED "B" is active low
+		if (dev->config->activity_led >= 0) {
+			gpio_set_value(dev->config->activity_led, 0);
+		}
+		ledfloor_write_frame(&dev->engine, &frame->out,
+			dev->config->clk_cycles, dev->config->latch_cycles,
+			dev->chunk_cols, &timing);
+		if (dev->config->activity_led >= 0) {
+			gpio_set_value(dev->config->activity_led, 1);
+		}
+		trace_ledfloor_shiftout_end(frame->fnum,
+			timing.shift_cycles + timing.latch_cycles,
+			timing.wait_cycles);
+		end = ktime_get();
+
+		spin_lock(&dev->lock);
+		dev->output_busy = false;
+		atomic_inc(&dev->fnum);
+		account_frame(dev, start, end);
+		dev->timing = timing;
+		hist_add(&dev->hists[LF_HIST_WAIT],
+			cycles_to_ns(timing.wait_cycles, 1));
+		hold_ns = cycles_to_ns(timing.hold_cycles, 1);
+		if (hold_ns > dev->max_hold_ns) {
+			dev->max_hold_ns = hold_ns;
+		}
+		hist_add(&dev->hists[LF_HIST_HOLD], hold_ns);
+		if (queued) {
+			/* Early frames count as on time */
+			lateness_ns = max_t(s64, ktime_to_ns(ktime_sub(end,
+						frame->pts)), 0);
+			hist_add(&dev->hists[LF_HIST_LATENESS],
+				min_t(s64, lateness_ns, UINT_MAX));
+			if (lateness_ns > QUEUE_LATE_NS) {
+				dev->frames_late++;
+			}
+		}
+		spin_unlock(&dev->lock);
+		wake_up_interruptible(&dev->wq);
+	}
+
+	hrtimer_cancel(&dev->governor_timer);
+
+	return 0;
+}
+
+static void free_floor(struct kref *kref);
+
+static int ledfloor_open(struct inode *inode, struct file *filp)
+{
+	struct ledfloor_dev_t *dev;
+	struct ledfloor_file_t *file;
+
+	/* Not through inode->i_cdev, the floor may be going away */
+	mutex_lock(&ledfloor_devs_lock);
+	dev = ledfloor_devs[iminor(inode) - MINOR(ledfloor_devid)];
+	if (dev) {
+		kref_get(&dev->kref);
+	}
+	mutex_unlock(&ledfloor_devs_lock);
+	if (!dev) {
+		return -ENODEV;
+	}
+
+	file = vmalloc(sizeof(*file));
+	if (!file) {
+		kref_put(&dev->kref, free_floor);
+		return -ENOMEM;
+	}
+	file->dev = dev;
+	file->snapshot_size = 0;
+	file->snapshot_fnum = 0;
+
+	filp->private_data = file;
+
+	return 0;
+}
+
+static int ledfloor_release(struct inode *inode, struct file *filp)
+{
+	struct ledfloor_file_t *file = filp->private_data;
+
+	kref_put(&file->dev->kref, free_floor);
+	vfree(file);
+
+	return 0;
+}
+
+static ssize_t ledfloor_read(struct file *filp, char __user *buf, size_t count, loff_t *f_pos)
+{
+	struct ledfloor_file_t *file = filp->private_data;
+	struct ledfloor_dev_t *dev = file->dev;
+
+	if (*f_pos == 0) {
+		/* Wait for a frame newer than the last one read */
+		if (!(filp->f_flags & O_NONBLOCK) &&
+			wait_event_interruptible(dev->wq, frame_shown(dev,
+					file->snapshot_fnum + 1) ||
+				dev->removed)) {
+			return -ERESTARTSYS;
+		}
+		if (dev->removed) {
+			return -ENODEV;
+		}
+		trace_ledfloor_reader_wakeup(atomic_read(&dev->fnum));
+
+		spin_lock(&dev->lock);
+		memcpy(file->snapshot, dev->shown->pixels, dev->shown->size);
+		file->snapshot_size = dev->shown->size;
+		file->snapshot_fnum = dev->shown->fnum;
+		spin_unlock(&dev->lock);
+	}
+
+	if (*f_pos >= file->snapshot_size) {
+		return 0;
+	}
+	if (*f_pos + count > file->snapshot_size) {
+		count = file->snapshot_size - *f_pos;
+	}
+
+	if (copy_to_user(buf, &file->snapshot[*f_pos], count)) {
+		return -EFAULT;
+	}
+
+	*f_pos += count;
+	BUG_ON(*f_pos > file->snapshot_size);
+	if (*f_pos == file->snapshot_size) {
+		*f_pos = 0;
+	}
+
+	return count;
+}
+
+static ssize_t ledfloor_write(struct file *filp, const char __user *buf, size_t count, loff_t *f_pos)
+{
+	struct ledfloor_file_t *file = filp->private_data;
+	struct ledfloor_dev_t *dev = file->dev;
+	size_t left_to_write = count;
+	size_t frame_size;
+	uint32_t start;
+
+	if (dev->removed) {
+		return -ENODEV;
+	}
+	if (mutex_lock_interruptible(&dev->write_lock)) {
+		return -ERESTARTSYS;
+	}
+
+	trace_ledfloor_write_start(count, *f_pos);
+	frame_size = LF_FRAME_SIZE(dev->config->rows, dev->config->cols,
+		dev->config->format);
+	/* The geometry was made smaller in the middle of a frame */
+	if (*f_pos >= frame_size) {
+		*f_pos = 0;
+	}
+
+	while (left_to_write)
+	{
+		size_t copy_count = left_to_write;
+
+		if (*f_pos + copy_count > frame_size) {
+			copy_count = frame_size - *f_pos;
+		}
+
+		start = sysreg_read(COUNT);
+		if (copy_from_user(&dev->back->pixels[*f_pos], buf,
+				copy_count)) {
+			mutex_unlock(&dev->write_lock);
+			return -EFAULT;
+		}
+		hist_add(&dev->hists[LF_HIST_COPY],
+			cycles_to_ns(sysreg_read(COUNT) - start, 1));
+		buf += copy_count;
+		left_to_write -= copy_count;
+		*f_pos += copy_count;
+		BUG_ON(*f_pos > frame_size);
+		if (*f_pos == frame_size) {
+			*f_pos = 0;
+			render_frame(dev, dev->back);
+			post_frame(dev);
+		}
+	}
+
+	mutex_unlock(&dev->write_lock);
+
+	return count;
+}
+
+/* POLLIN when a frame newer than the last one read has been clocked out,
+ * POLLOUT when the next frame written will not replace a pending one.
+ */
+static unsigned int ledfloor_poll(struct file *filp, poll_table *wait)
+{
+	struct ledfloor_file_t *file = filp->private_data;
+	struct ledfloor_dev_t *dev = file->dev;
+	unsigned int mask = 0;
+
+	poll_wait(filp, &dev->wq, wait);
+
+	if (dev->removed) {
+		return POLLERR | POLLHUP;
+	}
+	if (filp->f_pos != 0 || frame_shown(dev, file->snapshot_fnum + 1)) {
+		mask |= POLLIN | POLLRDNORM;
+	}
+	if (!dev->pending_fresh) {
+		mask |= POLLOUT | POLLWRNORM;
+	}
+
+	return mask;
+}
+
+/* Wait until every frame written so far has been clocked out */
+static int ledfloor_fsync(struct file *filp, struct dentry *dentry, int
+	datasync)
+{
+	struct ledfloor_file_t *file = filp->private_data;
+
+	if (wait_event_interruptible(file->dev->wq,
+			output_idle(file->dev) || file->dev->removed)) {
+		return -ERESTARTSYS;
+	}
+
+	return file->dev->removed ? -ENODEV : 0;
+}
+
+static int ledfloor_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+	struct ledfloor_file_t *file = filp->private_data;
+
+	if (file->dev->removed) {
+		return -ENODEV;
+	}
+
+	return remap_vmalloc_range(vma, file->dev->slot_area, vma->vm_pgoff);
+}
+
+/* Display the frame that a producer has put in slot through mmap(). On
+ * return, slot is the next one to fill.
+ */
+static int commit_slot(struct ledfloor_dev_t *dev, uint32_t *slot)
+{
+	if (mutex_lock_interruptible(&dev->write_lock)) {
+		return -ERESTARTSYS;
+	}
+
+	if (*slot != dev->back - dev->frames) {
+		mutex_unlock(&dev->write_lock);
+		return -EINVAL;
+	}
+
+	render_frame(dev, dev->back);
+	post_frame(dev);
+	*slot = dev->back - dev->frames;
+
+	mutex_unlock(&dev->write_lock);
+
+	return 0;
+}
+
+/* Make back hold the last frame posted, rendered with the current settings,
+ * for partial updates to apply to. Called under dev->write_lock, which
+ * keeps pending and front from being replaced by another frame.
+ */
+static void stage_frame(struct ledfloor_dev_t *dev)
+{
+	struct ledfloor_frame *back = dev->back, *src;
+
+	if (dev->back_stale) {
+		spin_lock(&dev->lock);
+		src = dev->pending_fresh ? dev->pending : dev->front;
+		spin_unlock(&dev->lock);
+
+		memcpy(back->pixels, src->pixels, LF_FRAME_SIZE(
+				dev->config->rows, dev->config->cols,
+				dev->config->format));
+		if (src->render_gen == dev->render_gen) {
+			memcpy(back->out.words, src->out.words,
+				src->out.nwords * sizeof(*src->out.words));
+			back->out.nwords = src->out.nwords;
+			memcpy(back->out.banks, src->out.banks,
+				sizeof(back->out.banks));
+			back->out.nbanks = src->out.nbanks;
+			back->out.hash = src->out.hash;
+			back->size = src->size;
+			back->render_gen = src->render_gen;
+		}
+		dev->back_stale = false;
+	}
+
+	if (back->render_gen != dev->render_gen) {
+		render_frame(dev, back);
+	}
+}
+
+/* LF_IOCUPDATE */
+static int update_rect(struct ledfloor_dev_t *dev, const struct lf_update
+	*update)
+{
+	const struct ledfloor_config *config = dev->config;
+	size_t row_size;
+	unsigned int i;
+	uint32_t start;
+
+	if (mutex_lock_interruptible(&dev->write_lock)) {
+		return -ERESTARTSYS;
+	}
+
+	/* RGB444 pixels don't all start on a byte */
+	if (config->format == LF_FMT_RGB444 || update->x > config->cols ||
+		update->width > config->cols - update->x || update->y >
+		config->rows || update->height > config->rows - update->y) {
+		mutex_unlock(&dev->write_lock);
+		return -EINVAL;
+	}
+
+	stage_frame(dev);
+
+	row_size = update->width * LF_FMT_BITS(config->format) / 8;
+	start = sysreg_read(COUNT);
+	for (i = 0; i < update->height; i++) {
+		if (copy_from_user(&dev->back->pixels[((update->y + i) *
+						config->cols + update->x) *
+					LF_FMT_BITS(config->format) / 8],
+				(const uint8_t __user *) update->pixels + i *
+				row_size, row_size)) {
+			mutex_unlock(&dev->write_lock);
+			return -EFAULT;
+		}
+	}
+	hist_add(&dev->hists[LF_HIST_COPY],
+		cycles_to_ns(sysreg_read(COUNT) - start, 1));
+
+	if (update->width && update->height) {
+		render_columns(dev, dev->back, update->x, update->width);
+	}
+	if (update->flags & LF_UPDATE_COMMIT) {
+		post_frame(dev);
+	}
+
+	mutex_unlock(&dev->write_lock);
+
+	return 0;
+}
+
+/* Whether LF_IOCQUEUE can add a frame to the queue */
+static bool queue_room(struct ledfloor_dev_t *dev)
+{
+	bool room;
+
+	spin_lock(&dev->lock);
+	room = dev->queue_count < queue_len;
+	spin_unlock(&dev->lock);
+
+	return room;
+}
+
+/* LF_IOCQUEUE, frames are rendered as they are queued so that the output
+ * thread only has to clock them out. Returns the number of frames queued
+ * or a negative error if there were none.
+ */
+static int queue_frames(struct ledfloor_dev_t *dev, struct file *filp, const
+	struct lf_queue *request)
+{
+	const unsigned int ring_len = queue_len + 1;
+	struct ledfloor_frame *frame, *last;
+	size_t frame_size;
+	uint32_t start;
+	int64_t pts;
+	unsigned int i;
+	int retval = 0;
+
+	if (!queue_len) {
+		return -EINVAL;
+	}
+
+	if (mutex_lock_interruptible(&dev->write_lock)) {
+		return -ERESTARTSYS;
+	}
+
+	/* The head stays put, the frame before it may be the one being
+	 * clocked out or shown and it must not be filled again */
+	if (request->flags & LF_QUEUE_FLUSH) {
+		spin_lock(&dev->lock);
+		dev->queue_count = 0;
+		spin_unlock(&dev->lock);
+	}
+
+	frame_size = LF_FRAME_SIZE(dev->config->rows, dev->config->cols,
+		dev->config->format);
+	for (i = 0; i < request->count; i++) {
+		/* Wait with write_lock dropped, other writers and a flush go
+		 * on meanwhile. Only write_lock holders add frames to the
+		 * queue, room found with it held stays. */
+		while (!queue_room(dev)) {
+			mutex_unlock(&dev->write_lock);
+			if (dev->removed) {
+				return i ? i : -ENODEV;
+			}
+			if (filp->f_flags & O_NONBLOCK) {
+				return i ? i : -EAGAIN;
+			}
+			if (wait_event_interruptible(dev->wq,
+					queue_room(dev) || dev->removed) ||
+				mutex_lock_interruptible(&dev->write_lock)) {
+				return i ? i : -ERESTARTSYS;
+			}
+			/* The frames are laid out in the format of the call */
+			if (LF_FRAME_SIZE(dev->config->rows,
+					dev->config->cols,
+					dev->config->format) != frame_size) {
+				retval = -EINVAL;
+				goto out;
+			}
+		}
+
+		/* request->pts was not checked along with arg */
+		if (copy_from_user(&pts, (const int64_t __user *)
+				request->pts + i, sizeof(pts))) {
+			retval = -EFAULT;
+			break;
+		}
+
+		/* Only the output thread takes frames off the queue, the tail
+		 * stays put */
+		spin_lock(&dev->lock);
+		frame = &dev->queue[(dev->queue_head + dev->queue_count) %
+			ring_len];
+		last = dev->queue_count ? &dev->queue[(dev->queue_head +
+				dev->queue_count - 1) % ring_len] : NULL;
+		spin_unlock(&dev->lock);
+
+		if (pts < 0 || (last && pts < ktime_to_ns(last->pts))) {
+			retval = -EINVAL;
+			break;
+		}
+
+		start = sysreg_read(COUNT);
+		if (copy_from_user(frame->pixels, (const uint8_t __user *)
+				request->pixels + i * frame_size, frame_size)) {
+			retval = -EFAULT;
+			break;
+		}
+		hist_add(&dev->hists[LF_HIST_COPY],
+			cycles_to_ns(sysreg_read(COUNT) - start, 1));
+		render_frame(dev, frame);
+		frame->pts = ns_to_ktime(pts);
+
+		spin_lock(&dev->lock);
+		dev->queue_count++;
+		spin_unlock(&dev->lock);
+		wake_up(&dev->output_wq);
+	}
+
+out:
+	mutex_unlock(&dev->write_lock);
+
+	return i ? i : retval;
+}
+
+/* Copy the tables passed to LF_IOCSGAMMATABLE, one table used for all
+ * channels in the format of gamma_c, or to LF_IOCSLUTS, 12 bit values per
+ * channel that are converted to that format.
+ */
+static struct ledfloor_lut *lut_from_user(const uint16_t __user *arg, bool
+	per_channel)
+{
+	struct ledfloor_lut *lut;
+	int c, i;
+
+	lut = kmalloc(sizeof(*lut), GFP_KERNEL);
+	if (!lut) {
+		return ERR_PTR(-ENOMEM);
+	}
+
+	if (!per_channel) {
+		if (copy_from_user(lut->channels[0], arg,
+				sizeof(lut->channels[0]))) {
+			kfree(lut);
+			return ERR_PTR(-EFAULT);
+		}
+		memcpy(lut->channels[1], lut->channels[0],
+			sizeof(lut->channels[0]));
+		memcpy(lut->channels[2], lut->channels[0],
+			sizeof(lut->channels[0]));
+
+		return lut;
+	}
+
+	if (copy_from_user(lut->channels, arg, sizeof(lut->channels))) {
+		kfree(lut);
+		return ERR_PTR(-EFAULT);
+	}
+	for (c = 0; c < 3; c++) {
+		for (i = 0; i < 256; i++) {
+			if (lut->channels[c][i] > 0xfff) {
+				kfree(lut);
+				return ERR_PTR(-EINVAL);
+			}
+			lut->channels[c][i] = (bitrev16(lut->channels[c][i]) >>
+				4) ^ 0xfff;
+		}
+	}
+
+	return lut;
+}
+
+static int ledfloor_ioctl(struct inode *inode, struct file *filp, unsigned
+	int cmd, unsigned long arg)
+{
+	struct ledfloor_file_t *file = filp->private_data;
+	struct ledfloor_dev_t *dev = file->dev;
+	int err = 0;
+	int retval = 0;
+	uint32_t slot, n;
+	struct lf_geometry geometry;
+	struct ledfloor_timing timing;
+	struct lf_timing achieved;
+	struct ledfloor_lut *lut;
+	struct lf_update update;
+	struct lf_queue queue;
+	struct lf_map map;
+	struct lf_gains gains;
+
+	if (_IOC_TYPE(cmd) != LF_IOC_MAGIC) {
+		return -ENOTTY;
+	}
+	if (_IOC_NR(cmd) >= LF_IOC_NB) {
+		return -ENOTTY;
+	}
+	if (dev->removed) {
+		return -ENODEV;
+	}
+
+	if (_IOC_DIR(cmd) & _IOC_READ) {
+		err = !access_ok(VERIFY_WRITE, (void __user *) arg,
+			_IOC_SIZE(cmd));
+	}
+	else if (_IOC_DIR(cmd) & _IOC_WRITE) {
+		err = !access_ok(VERIFY_READ, (void __user *) arg,
+			_IOC_SIZE(cmd));
+	}
+	if (err) {
+		return -EFAULT;
+	}
+
+	switch (cmd) {
+		case LF_IOCSLATCHNDELAY:
+			retval = __get_user(dev->config->latch_ndelay,
+				(uint32_t __user *) arg);
+			set_delays(dev->config);
+			trace_ledfloor_config("latch_ndelay",
+				dev->config->latch_ndelay);
+#ifndef CONFIG_AVR32
+			printk(KERN_INFO "ledfloor latch_ndelay = %u\n",
+				dev->config->latch_ndelay);
+#endif
+			break;
+
+		case LF_IOCSCLKNDELAY:
+			retval = __get_user(dev->config->clk_ndelay,
+				(uint32_t __user *) arg);
+			set_delays(dev->config);
+			trace_ledfloor_config("clk_ndelay",
+				dev->config->clk_ndelay);
+#ifndef CONFIG_AVR32
+			printk(KERN_INFO "ledfloor clk_ndelay = %u\n",
+				dev->config->clk_ndelay);
+#endif
+			break;
+
+		case LF_IOCGFNUM:
+			retval = __put_user(file->snapshot_fnum, (uint32_t
+					__user *) arg);
+			break;
+
+		case LF_IOCGSLOT:
+			mutex_lock(&dev->write_lock);
+			slot = dev->back - dev->frames;
+			mutex_unlock(&dev->write_lock);
+			retval = __put_user(slot, (uint32_t __user *) arg);
+			break;
+
+		case LF_IOCCOMMIT:
+			retval = __get_user(slot, (uint32_t __user *) arg);
+			if (retval) {
+				break;
+			}
+			retval = commit_slot(dev, &slot);
+			if (retval) {
+				break;
+			}
+			retval = __put_user(slot, (uint32_t __user *) arg);
+			break;
+
+		case LF_IOCWAITFRAME:
+			retval = __get_user(n, (uint32_t __user *) arg);
+			if (retval) {
+				break;
+			}
+			if (n && wait_event_interruptible(dev->wq,
+					frame_shown(dev, n) || dev->removed)) {
+				retval = -ERESTARTSYS;
+				break;
+			}
+			if (dev->removed) {
+				retval = -ENODEV;
+				break;
+			}
+			if (n) {
+				trace_ledfloor_reader_wakeup(
+					atomic_read(&dev->fnum));
+			}
+			retval = __put_user(atomic_read(&dev->fnum), (uint32_t
+					__user *) arg);
+			break;
+
+		case LF_IOCSGEOMETRY:
+			if (copy_from_user(&geometry, (struct lf_geometry
+						__user *) arg, sizeof(geometry))) {
+				retval = -EFAULT;
+				break;
+			}
+			mutex_lock(&dev->write_lock);
+			retval = set_geometry(dev, geometry.rows,
+				geometry.cols);
+			mutex_unlock(&dev->write_lock);
+			trace_ledfloor_config("rows", dev->config->rows);
+			trace_ledfloor_config("cols", dev->config->cols);
+#ifndef CONFIG_AVR32
+			printk(KERN_INFO "ledfloor geometry = %ux%u\n",
+				dev->config->cols, dev->config->rows);
+#endif
+			break;
+
+		case LF_IOCGGEOMETRY:
+			mutex_lock(&dev->write_lock);
+			geometry.rows = dev->config->rows;
+			geometry.cols = dev->config->cols;
+			mutex_unlock(&dev->write_lock);
+			if (copy_to_user((struct lf_geometry __user *) arg,
+					&geometry, sizeof(geometry))) {
+				retval = -EFAULT;
+			}
+			break;
+
+		case LF_IOCUPDATE:
+			if (copy_from_user(&update, (struct lf_update __user *)
+					arg, sizeof(update))) {
+				retval = -EFAULT;
+				break;
+			}
+			retval = update_rect(dev, &update);
+			break;
+
+		case LF_IOCSMAP:
+			if (copy_from_user(&map, (struct lf_map __user *) arg,
+					sizeof(map))) {
+				retval = -EFAULT;
+				break;
+			}
+			mutex_lock(&dev->write_lock);
+			retval = set_map(dev, &map);
+			mutex_unlock(&dev->write_lock);
+			trace_ledfloor_config("map", dev->config->map != NULL);
+			break;
+
+		case LF_IOCSGAINS:
+			if (copy_from_user(&gains, (struct lf_gains __user *)
+					arg, sizeof(gains))) {
+				retval = -EFAULT;
+				break;
+			}
+			mutex_lock(&dev->write_lock);
+			retval = set_gains(dev, &gains);
+			mutex_unlock(&dev->write_lock);
+			trace_ledfloor_config("gains", dev->config->gain_classes
+				!= NULL);
+			break;
+
+		case LF_IOCQUEUE:
+			if (copy_from_user(&queue, (struct lf_queue __user *)
+					arg, sizeof(queue))) {
+				retval = -EFAULT;
+				break;
+			}
+			retval = queue_frames(dev, filp, &queue);
+			if (retval < 0) {
+				break;
+			}
+			retval = __put_user(retval, &((struct lf_queue __user *)
+					arg)->count);
+			break;
+
+		case LF_IOCSFORMAT:
+			retval = __get_user(n, (uint32_t __user *) arg);
+			if (retval) {
+				break;
+			}
+			mutex_lock(&dev->write_lock);
+			retval = set_format(dev, n);
+			mutex_unlock(&dev->write_lock);
+			trace_ledfloor_config("format", dev->config->format);
+			break;
+
+		case LF_IOCGFORMAT:
+			retval = __put_user(dev->config->format, (uint32_t
+					__user *) arg);
+			break;
+
+		case LF_IOCGTIMING:
+			spin_lock(&dev->lock);
+			timing = dev->timing;
+			spin_unlock(&dev->lock);
+			if (!timing.clocks) {
+				retval = -ENODATA;
+				break;
+			}
+
+			achieved.cycles_khz = cycles_khz;
+			achieved.clk_period_ns =
+				cycles_to_ns(timing.shift_cycles,
+					timing.clocks);
+			achieved.latch_ns = cycles_to_ns(timing.latch_cycles,
+				1);
+			if (copy_to_user((struct lf_timing __user *) arg,
+					&achieved, sizeof(achieved))) {
+				retval = -EFAULT;
+			}
+			break;
+
+		case LF_IOCSGAMMATABLE:
+		case LF_IOCSLUTS:
+			lut = lut_from_user((uint16_t __user *) arg, cmd ==
+				LF_IOCSLUTS);
+			if (IS_ERR(lut)) {
+				retval = PTR_ERR(lut);
+				break;
+			}
+			mutex_lock(&dev->write_lock);
+			memcpy(lut->palette_rgb, dev->luts->palette_rgb,
+				sizeof(lut->palette_rgb));
+			memcpy(lut->gains, dev->luts->gains,
+				sizeof(lut->gains));
+			ledfloor_derive_lut(lut);
+			set_luts(dev, lut);
+			mutex_unlock(&dev->write_lock);
+			trace_ledfloor_config(cmd == LF_IOCSLUTS ? "luts" :
+				"gamma_table", 0);
+#ifndef CONFIG_AVR32
+			printk(KERN_INFO "ledfloor new gamma\n");
+#endif
+			break;
+
+		case LF_IOCSPALETTE:
+			lut = kmalloc(sizeof(*lut), GFP_KERNEL);
+			if (!lut) {
+				retval = -ENOMEM;
+				break;
+			}
+			mutex_lock(&dev->write_lock);
+			memcpy(lut->channels, dev->luts->channels,
+				sizeof(lut->channels));
+			memcpy(lut->gains, dev->luts->gains,
+				sizeof(lut->gains));
+			if (copy_from_user(lut->palette_rgb, (struct lf_palette
+						__user *) arg,
+					sizeof(lut->palette_rgb))) {
+				mutex_unlock(&dev->write_lock);
+				kfree(lut);
+				retval = -EFAULT;
+				break;
+			}
+			ledfloor_derive_lut(lut);
+			set_luts(dev, lut);
+			mutex_unlock(&dev->write_lock);
+			trace_ledfloor_config("palette", 0);
+			break;
+
+		default:
+			/* Command number has already been checked */
+			BUG();
+	}
+
+	return retval;
+}
+
+struct file_operations ledfloor_fops = {
+	.owner = THIS_MODULE,
+	.read = ledfloor_read,
+	.write = ledfloor_write,
+	.ioctl = ledfloor_ioctl,
+	.poll = ledfloor_poll,
+	.fsync = ledfloor_fsync,
+	.mmap = ledfloor_mmap,
+	.open = ledfloor_open,
+	.release = ledfloor_release,
+};
+
+static ssize_t frame_interval_us_show(struct device *device, struct
+	device_attribute *attr, char *buf)
+{
+	struct ledfloor_dev_t *dev = dev_get_drvdata(device);
+
+	return sprintf(buf, "%u\n", dev->frame_interval_us);
+}
+
+static ssize_t frame_interval_us_store(struct device *device, struct
+	device_attribute *attr, const char *buf, size_t count)
+{
+	struct ledfloor_dev_t *dev = dev_get_drvdata(device);
+	unsigned long value;
+
+	if (strict_strtoul(buf, 10, &value)) {
+		return -EINVAL;
+	}
+	dev->frame_interval_us = value;
+
+	return count;
+}
+
+static ssize_t chunk_cols_show(struct device *device, struct
+	device_attribute *attr, char *buf)
+{
+	struct ledfloor_dev_t *dev = dev_get_drvdata(device);
+
+	return sprintf(buf, "%u\n", dev->chunk_cols);
+}
+
+static ssize_t chunk_cols_store(struct device *device, struct
+	device_attribute *attr, const char *buf, size_t count)
+{
+	struct ledfloor_dev_t *dev = dev_get_drvdata(device);
+	unsigned long value;
+
+	if (strict_strtoul(buf, 10, &value) || value > LF_MAXCOLS) {
+		return -EINVAL;
+	}
+	dev->chunk_cols = value;
+
+	return count;
+}
+
+static ssize_t fps_show(struct device *device, struct device_attribute
+	*attr, char *buf)
+{
+	struct ledfloor_dev_t *dev = dev_get_drvdata(device);
+	unsigned long centi_fps = 0;
+
+	spin_lock(&dev->lock);
+	/* Nothing shown for a second or more is no frame rate at all */
+	if (dev->avg_interval_ns && ktime_to_ns(ktime_sub(ktime_get(),
+				dev->last_shown)) < NSEC_PER_SEC) {
+		centi_fps = div_u64(100 * (u64) NSEC_PER_SEC,
+			dev->avg_interval_ns);
+	}
+	spin_unlock(&dev->lock);
+
+	return sprintf(buf, "%lu.%02lu\n", centi_fps / 100, centi_fps % 100);
+}
+
+static ssize_t frames_shown_show(struct device *device, struct
+	device_attribute *attr, char *buf)
+{
+	struct ledfloor_dev_t *dev = dev_get_drvdata(device);
+
+	return sprintf(buf, "%u\n", atomic_read(&dev->fnum));
+}
+
+static ssize_t frames_coalesced_show(struct device *device, struct
+	device_attribute *attr, char *buf)
+{
+	struct ledfloor_dev_t *dev = dev_get_drvdata(device);
+
+	return sprintf(buf, "%lu\n", dev->frames_coalesced);
+}
+
+static ssize_t frames_elided_show(struct device *device, struct
+	device_attribute *attr, char *buf)
+{
+	struct ledfloor_dev_t *dev = dev_get_drvdata(device);
+
+	return sprintf(buf, "%lu\n", dev->frames_elided);
+}
+
+static ssize_t max_shiftout_ns_show(struct device *device, struct
+	device_attribute *attr, char *buf)
+{
+	struct ledfloor_dev_t *dev = dev_get_drvdata(device);
+
+	return sprintf(buf, "%lu\n", dev->max_shiftout_ns);
+}
+
+static DEVICE_ATTR(frame_interval_us, S_IRUGO | S_IWUSR,
+	frame_interval_us_show, frame_interval_us_store);
+static DEVICE_ATTR(chunk_cols, S_IRUGO | S_IWUSR, chunk_cols_show,
+	chunk_cols_store);
+static DEVICE_ATTR(fps, S_IRUGO, fps_show, NULL);
+static DEVICE_ATTR(frames_shown, S_IRUGO, frames_shown_show, NULL);
+static DEVICE_ATTR(frames_coalesced, S_IRUGO, frames_coalesced_show, NULL);
+static DEVICE_ATTR(frames_elided, S_IRUGO, frames_elided_show, NULL);
+static ssize_t frames_late_show(struct device *device, struct
+	device_attribute *attr, char *buf)
+{
+	struct ledfloor_dev_t *dev = dev_get_drvdata(device);
+
+	return sprintf(buf, "%lu\n", dev->frames_late);
+}
+
+static ssize_t frames_skipped_show(struct device *device, struct
+	device_attribute *attr, char *buf)
+{
+	struct ledfloor_dev_t *dev = dev_get_drvdata(device);
+
+	return sprintf(buf, "%lu\n", dev->frames_skipped);
+}
+
+static ssize_t max_hold_ns_show(struct device *device, struct
+	device_attribute *attr, char *buf)
+{
+	struct ledfloor_dev_t *dev = dev_get_drvdata(device);
+
+	return sprintf(buf, "%lu\n", dev->max_hold_ns);
+}
+
+static DEVICE_ATTR(max_shiftout_ns, S_IRUGO, max_shiftout_ns_show, NULL);
+static DEVICE_ATTR(max_hold_ns, S_IRUGO, max_hold_ns_show, NULL);
+static DEVICE_ATTR(frames_late, S_IRUGO, frames_late_show, NULL);
+static DEVICE_ATTR(frames_skipped, S_IRUGO, frames_skipped_show, NULL);
+
+static struct attribute *ledfloor_attrs[] = {
+	&dev_attr_frame_interval_us.attr,
+	&dev_attr_chunk_cols.attr,
+	&dev_attr_fps.attr,
+	&dev_attr_frames_shown.attr,
+	&dev_attr_frames_coalesced.attr,
+	&dev_attr_frames_elided.attr,
+	&dev_attr_max_shiftout_ns.attr,
+	&dev_attr_max_hold_ns.attr,
+	&dev_attr_frames_late.attr,
+	&dev_attr_frames_skipped.attr,
+	NULL,
+};
+
+static struct attribute_group ledfloor_attr_group = {
+	.attrs = ledfloor_attrs,
+};
+
+/* debugfs, one file per histogram and a reset file that clears them all
+ * when anything is written to it. Percentiles are given as the upper bound
+ * of the bucket they fall in.
+ */
+static int hist_show(struct seq_file *m, void *v)
+{
+	struct ledfloor_hist *hist = m->private, copy;
+	static const unsigned int permilles[] = {500, 900, 990, 999};
+	static const char *percentiles[] = {"p50", "p90", "p99", "p99.9"};
+	unsigned long seen = 0;
+	unsigned int n, p = 0;
+
+	spin_lock(&hist->lock);
+	copy = *hist;
+	spin_unlock(&hist->lock);
+
+	seq_printf(m, "count %lu\nmin %lu\nmax %lu\n", copy.count, copy.min,
+		copy.max);
+	if (!copy.count) {
+		return 0;
+	}
+
+	for (n = 0; n < LF_HIST_BUCKETS; n++) {
+		seen += copy.buckets[n];
+		while (p < ARRAY_SIZE(permilles) && seen > div_u64((u64)
+				copy.count * permilles[p], 1000)) {
+			seq_printf(m, "%s %lu\n", percentiles[p],
+				clamp_t(unsigned long, n ? (2UL << (n - 1)) -
+					1 : 0, copy.min, copy.max));
+			p++;
+		}
+	}
+	for (n = 0; n < LF_HIST_BUCKETS; n++) {
+		if (copy.buckets[n]) {
+			seq_printf(m, "%lu-%lu %lu\n", n ? 1UL << (n - 1) : 0,
+				n ? (2UL << (n - 1)) - 1 : 0, copy.buckets[n]);
+		}
+	}
+
+	return 0;
+}
+
+static int hist_open(struct inode *inode, struct file *filp)
+{
+	return single_open(filp, hist_show, inode->i_private);
+}
+
+static const struct file_operations hist_fops = {
+	.owner = THIS_MODULE,
+	.open = hist_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+static int hist_reset_open(struct inode *inode, struct file *filp)
+{
+	filp->private_data = inode->i_private;
+
+	return 0;
+}
+
+static ssize_t hist_reset_write(struct file *filp, const char __user *buf,
+	size_t count, loff_t *f_pos)
+{
+	struct ledfloor_dev_t *dev = filp->private_data;
+	unsigned int i;
+
+	for (i = 0; i < LF_HIST_NB; i++) {
+		hist_reset(&dev->hists[i]);
+	}
+
+	return count;
+}
+
+static const struct file_operations hist_reset_fops = {
+	.owner = THIS_MODULE,
+	.open = hist_reset_open,
+	.write = hist_reset_write,
+};
+
+static void ledfloor_debugfs_init(struct ledfloor_dev_t *dev)
+{
+	char name[16];
+	unsigned int i;
+
+	snprintf(name, sizeof(name), "ledfloor%d", dev->id);
+	dev->debugfs_dir = debugfs_create_dir(name, NULL);
+	/* ERR_PTR(-ENODEV) without CONFIG_DEBUG_FS */
+	if (!dev->debugfs_dir || IS_ERR(dev->debugfs_dir)) {
+		dev->debugfs_dir = NULL;
+		return;
+	}
+
+	for (i = 0; i < LF_HIST_NB; i++) {
+		debugfs_create_file(dev->hists[i].name, S_IRUGO,
+			dev->debugfs_dir, &dev->hists[i], &hist_fops);
+	}
+	debugfs_create_file("reset", S_IWUSR, dev->debugfs_dir, dev,
+		&hist_reset_fops);
+}
+
+/* Whether two floors have data lines on the same port. They would clobber
+ * each other's lines, the output write enable mask of a port being shared.
+ */
+static bool ports_shared(const struct ledfloor_config *a, const struct
+	ledfloor_config *b)
+{
+	unsigned int i, j;
+
+	for (i = 0; i < a->data_lines; i++) {
+		for (j = 0; j < b->data_lines; j++) {
+			if (GPIO_BANK(a->data[i]) == GPIO_BANK(b->data[j])) {
+				return true;
+			}
+		}
+	}
+
+	return false;
+}
+
+/* Last reference to a removed floor dropped, by remove or the release of
+ * its last open file */
+static void free_floor(struct kref *kref)
+{
+	struct ledfloor_dev_t *dev = container_of(kref, struct
+		ledfloor_dev_t, kref);
+
+	vfree(dev->queue);
+	vfree(dev->queue_pixels);
+	vfree(dev->slot_area);
+	kfree(dev->config->map);
+	kfree(dev->config->gain_classes);
+	kfree(dev->config);
+	free_luts(dev);
+	vfree(dev);
+}
+
+static int __init platform_ledfloor_probe(struct platform_device *pdev)
+{
+	struct ledfloor_dev_t *dev;
+	char name[16];
+	int ret;
+	unsigned int i;
+
+	dev_notice(&pdev->dev, "probe() called\n");
+
+	if (pdev->id < 0 || pdev->id >= LEDFLOOR_MAXDEVS) {
+		return -EINVAL;
+	}
+
+	/* Too big for kmalloc(), the frames hold their port words */
+	dev = vmalloc(sizeof(*dev));
+	if (!dev) {
+		return -ENOMEM;
+	}
+	memset(dev, 0, sizeof(*dev));
+	dev->id = pdev->id;
+	kref_init(&dev->kref);
+	/* Kept until the last file is closed, unlike the platform data */
+	dev->config = kmemdup(pdev->dev.platform_data, sizeof(*dev->config),
+		GFP_KERNEL);
+	if (!dev->config) {
+		vfree(dev);
+		return -ENOMEM;
+	}
+	dev->back = &dev->frames[0];
+	dev->pending = &dev->frames[1];
+	dev->front = &dev->frames[2];
+	dev->shown = &dev->frames[2];
+	spin_lock_init(&dev->lock);
+	mutex_init(&dev->write_lock);
+	init_waitqueue_head(&dev->output_wq);
+	init_waitqueue_head(&dev->wq);
+	atomic_set(&dev->fnum, 0);
+	for (i = 0; i < LF_HIST_NB; i++) {
+		dev->hists[i].name = hist_names[i];
+		spin_lock_init(&dev->hists[i].lock);
+	}
+	dev->luts = &dev->default_lut;
+	dev->render_gen = 1;
+
+	mutex_lock(&ledfloor_devs_lock);
+	for (i = 0; i < LEDFLOOR_MAXDEVS; i++) {
+		if (!gpiolib && ledfloor_devs[i] &&
+				ports_shared(ledfloor_devs[i]->config,
+				dev->config)) {
+			dev_warn(&pdev->dev, "data lines on a port used by "
+				"ledfloor%u\n", i);
+			ret = -EBUSY;
+			goto fail_dev;
+		}
+	}
+
+	ret = gpio_init(dev);
+	if (ret < 0) {
+		dev_warn(&pdev->dev, "gpio_init() failed\n");
+		goto fail_dev;
+	}
+
+	set_delays(dev->config);
+
+	for (i = 0; i < 3; i++) {
+		memcpy(dev->default_lut.channels[i], gamma_c,
+			sizeof(gamma_c));
+	}
+	/* Shades of grey */
+	for (i = 0; i < 256; i++) {
+		memset(dev->default_lut.palette_rgb[i], i,
+			sizeof(dev->default_lut.palette_rgb[i]));
+	}
+	for (i = 0; i < LF_GAIN_CLASSES; i++) {
+		dev->default_lut.gains[i] = LF_GAIN_ONE;
+	}
+	ledfloor_derive_lut(&dev->default_lut);
+
+	ret = set_geometry(dev, dev->config->rows, dev->config->cols);
+	if (ret < 0) {
+		dev_warn(&pdev->dev, "invalid geometry %ux%u\n",
+			dev->config->cols, dev->config->rows);
+		goto fail_gpio;
+	}
+
+	ret = -ENOMEM;
+	dev->slot_area = vmalloc_user(LF_SLOTS * LF_SLOT_SIZE(PAGE_SIZE));
+	if (!dev->slot_area) {
+		dev_warn(&pdev->dev, "can't allocate frame slots\n");
+		goto fail_gpio;
+	}
+	for (i = 0; i < LF_SLOTS; i++) {
+		dev->frames[i].pixels = dev->slot_area + i *
+			LF_SLOT_SIZE(PAGE_SIZE);
+		dev->frames[i].size = LF_FRAME_SIZE(dev->config->rows,
+			dev->config->cols, dev->config->format);
+	}
+
+	if (queue_len) {
+		dev->queue = vmalloc((queue_len + 1) * sizeof(*dev->queue));
+		dev->queue_pixels = vmalloc((queue_len + 1) *
+			LF_MAX_FRAME_SIZE);
+		if (!dev->queue || !dev->queue_pixels) {
+			dev_warn(&pdev->dev, "can't allocate frame queue\n");
+			goto fail_buffers;
+		}
+		memset(dev->queue, 0, (queue_len + 1) * sizeof(*dev->queue));
+		for (i = 0; i < queue_len + 1; i++) {
+			dev->queue[i].pixels = dev->queue_pixels + i *
+				LF_MAX_FRAME_SIZE;
+		}
+	}
+
+	dev->frame_interval_us = frame_interval_us;
+	dev->chunk_cols = min_t(unsigned int, chunk_cols, LF_MAXCOLS);
+	hrtimer_init(&dev->governor_timer, CLOCK_MONOTONIC,
+		HRTIMER_MODE_ABS);
+	dev->governor_timer.function = governor_timer_fn;
+
+	snprintf(name, sizeof(name), "ledfloor%d", dev->id);
+	dev->output_thread = kthread_run(output_thread, dev, name);
+	if (IS_ERR(dev->output_thread)) {
+		dev_warn(&pdev->dev, "can't start output thread\n");
+		ret = PTR_ERR(dev->output_thread);
+		goto fail_buffers;
+	}
+
+	dev->devid = MKDEV(MAJOR(ledfloor_devid), MINOR(ledfloor_devid) +
+		dev->id);
+	cdev_init(&dev->cdev, &ledfloor_fops);
+	dev->cdev.owner = THIS_MODULE;
+	dev->cdev.ops = &ledfloor_fops;
+
+	ret = cdev_add(&dev->cdev, dev->devid, 1);
+	if (ret < 0) {
+		printk(KERN_WARNING "ledfloor: can't add device\n");
+		goto fail_thread;
+	}
+
+	dev->device = device_create(ledfloor_class, NULL, dev->devid, dev,
+		"ledfloor%d", dev->id);
+	if (!IS_ERR(dev->device) && sysfs_create_group(&dev->device->kobj,
+			&ledfloor_attr_group)) {
+		dev_warn(&pdev->dev, "can't create sysfs attributes\n");
+	}
+	ledfloor_debugfs_init(dev);
+
+	platform_set_drvdata(pdev, dev);
+	ledfloor_devs[dev->id] = dev;
+	mutex_unlock(&ledfloor_devs_lock);
+
+	return 0;
+
+fail_thread:
+	kthread_stop(dev->output_thread);
+fail_buffers:
+	vfree(dev->queue);
+	vfree(dev->queue_pixels);
+	vfree(dev->slot_area);
+fail_gpio:
+	gpio_exit(dev);
+fail_dev:
+	mutex_unlock(&ledfloor_devs_lock);
+	kfree(dev->config);
+	vfree(dev);
+
+	return ret;
+}
+
+
+static int __exit platform_ledfloor_remove(struct platform_device *pdev)
+{
+	struct ledfloor_dev_t *dev = platform_get_drvdata(pdev);
+
+	dev_notice(&pdev->dev, "remove() called\n");
+
+	mutex_lock(&ledfloor_devs_lock);
+	ledfloor_devs[dev->id] = NULL;
+	mutex_unlock(&ledfloor_devs_lock);
+
+	debugfs_remove_recursive(dev->debugfs_dir);
+	if (!IS_ERR(dev->device)) {
+		sysfs_remove_group(&dev->device->kobj, &ledfloor_attr_group);
+	}
+	device_destroy(ledfloor_class, dev->devid);
+	cdev_del(&dev->cdev);
+
+	/* Files still open may be waiting for frames */
+	spin_lock(&dev->lock);
+	dev->removed = true;
+	spin_unlock(&dev->lock);
+	wake_up_all(&dev->wq);
+	kthread_stop(dev->output_thread);
+	gpio_exit(dev);
+
+	dev_info(&pdev->dev, "%d frames shown, %lu coalesced, %lu elided, "
+		"%lu late, %lu skipped\n", atomic_read(&dev->fnum),
+		dev->frames_coalesced, dev->frames_elided, dev->frames_late,
+		dev->frames_skipped);
+
+	kref_put(&dev->kref, free_floor);
+
+	return 0;
+}
+
+
+#ifdef CONFIG_PM
+static int
+platform_ledfloor_suspend(struct platform_device *pdev, pm_message_t state)
+{
+	/* Add code to suspend the device here */
+
+	dev_notice(&pdev->dev, "suspend() called\n");
+
+	return 0;
+}
+
+static int platform_ledfloor_resume(struct platform_device *pdev)
+{
+	/* Add code to resume the device here */
+
+	dev_notice(&pdev->dev, "resume() called\n");
+
+	return 0;
+}
+#else
+/* No need to do suspend/resume if power management is disabled */
+# define platform_ledfloor_suspend NULL
+# define platform_ledfloor_resume NULL
+#endif
+
+
+static struct platform_driver ledfloor_driver = {
+	.probe		= &platform_ledfloor_probe,
+	.remove		= __exit_p(&platform_ledfloor_remove),
+	.suspend	= &platform_ledfloor_suspend,
+	.resume		= &platform_ledfloor_resume,
+	.driver	= {
+		.name	= "ledfloor",
+	},
+};
+
+/* Add the platform device of floor id, wired as in config */
+static int __init add_floor(int id, const struct ledfloor_config *config)
+{
+	struct platform_device *pdev;
+	int ret;
+
+	pdev = platform_device_alloc("ledfloor", id);
+	if (!pdev) {
+		return -ENOMEM;
+	}
+
+	/* Note that the data is copied into a new dynamically allocated
+	 * structure.
+	 */
+	ret = platform_device_add_data(pdev, config, sizeof(*config));
+	if (ret) {
+		goto fail;
+	}
+
+	printk(KERN_INFO "ledfloor registering device \"%s.%d\"...\n",
+		pdev->name, pdev->id);
+	ret = platform_device_add(pdev);
+	if (ret) {
+		goto fail;
+	}
+	ledfloor_gpio_devices[id] = pdev;
+
+	return 0;
+fail:
+	/*
+	 * The device was never registered, so we may free it
+	 * directly. Any dynamically allocated resources and
+	 * platform data will be freed automatically.
+	 */
+	platform_device_put(pdev);
+
+	return ret;
+}
+
+static void ledfloor_del_floors(void)
+{
+	int i;
+
+	for (i = 0; i < LEDFLOOR_MAXDEVS; i++) {
+		if (!ledfloor_gpio_devices[i]) {
+			continue;
+		}
+
+		printk(KERN_INFO "ledfloor removing device \"%s.%d\"...\n",
+			ledfloor_gpio_devices[i]->name,
+			ledfloor_gpio_devices[i]->id);
+		platform_device_del(ledfloor_gpio_devices[i]);
+		ledfloor_gpio_devices[i] = NULL;
+	}
+}
+
+static int __init ledfloor_init(void)
+{
+	struct ledfloor_config config1;
+	int ret;
+
+	printk(KERN_INFO "ledfloor init\n");
+
+	if (nr_data_pins) {
+		memcpy(ledfloor_config_data.data, data_pins,
+			sizeof(ledfloor_config_data.data));
+		ledfloor_config_data.data_lines = nr_data_pins;
+		ledfloor_config_data.rows = nr_data_pins;
+	}
+	if (rows) {
+		ledfloor_config_data.rows = rows;
+	}
+	if (cols) {
+		ledfloor_config_data.cols = cols;
+	}
+	if (gpiolib && (!nr_data_pins || clk_pin < 0 || latch_pin < 0 ||
+			blank_pin < 0)) {
+		printk(KERN_ERR "ledfloor gpiolib without data, clock, latch "
+			"or blank lines\n");
+		return -EINVAL;
+	}
+	if (clk_pin >= 0) {
+		ledfloor_config_data.clk = clk_pin;
+	}
+	if (latch_pin >= 0) {
+		ledfloor_config_data.latch = latch_pin;
+	}
+	if (blank_pin >= 0) {
+		ledfloor_config_data.blank = blank_pin;
+	}
+	ledfloor_config_data.activity_led = activity_led;
+
+	/* Same delays and format as the first floor, its own lines */
+	config1 = ledfloor_config_data;
+	if (nr_data_pins1) {
+		if (clk_pin1 < 0 || latch_pin1 < 0 || blank_pin1 < 0) {
+			printk(KERN_ERR "ledfloor second floor without clock, "
+				"latch or blank line\n");
+			return -EINVAL;
+		}
+		memcpy(config1.data, data_pins1, sizeof(config1.data));
+		config1.data_lines = nr_data_pins1;
+		config1.rows = nr_data_pins1;
+		config1.clk = clk_pin1;
+		config1.latch = latch_pin1;
+		config1.blank = blank_pin1;
+		config1.activity_led = -1;
+	}
+
+	calibrate_cycles();
+	ret = transpose_bench();
+	if (ret < 0) {
+		return ret;
+	}
+
+	ret = alloc_chrdev_region(&ledfloor_devid, 0, LEDFLOOR_MAXDEVS,
+		"ledfloor");
+	if (ret < 0) {
+		printk(KERN_WARNING "ledfloor: can't get major number\n");
+		return ret;
+	}
+	ledfloor_class = class_create(THIS_MODULE, "ledfloor");
+
+	ret = add_floor(0, &ledfloor_config_data);
+	if (!ret && nr_data_pins1) {
+		ret = add_floor(1, &config1);
+	}
+	if (!ret) {
+		ret = platform_driver_register(&ledfloor_driver);
+	}
+	if (ret) {
+		ledfloor_del_floors();
+		class_destroy(ledfloor_class);
+		unregister_chrdev_region(ledfloor_devid, LEDFLOOR_MAXDEVS);
+	}
+
+	return ret;
+}
+module_init(ledfloor_init);
+
+
+static void __exit ledfloor_exit(void)
+{
+	printk(KERN_INFO "ledfloor exit\n");
+
+	platform_driver_unregister(&ledfloor_driver);
+	ledfloor_del_floors();
+	class_destroy(ledfloor_class);
+	unregister_chrdev_region(ledfloor_devid, LEDFLOOR_MAXDEVS);
+	/* Tables replaced with set_luts() may still be waiting to be
+	 * freed by free_lut() */
+	rcu_barrier();
+}
+module_exit(ledfloor_exit);
+
+
+MODULE_DESCRIPTION("LED dance floor framebuffer through avr32 GPIO pins");
+MODULE_AUTHOR("Benjamin Poirier <benjamin.poirier@gmail.com>");
+MODULE_LICENSE("GPL");
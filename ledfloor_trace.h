@@ -0,0 +1,181 @@
+/* Tracepoints for the frame lifecycle, under events/ledfloor/ in ftrace and
+ * as ledfloor:* events in perf. A frame goes through write_start (once per
+ * write() call), frame_complete when it is posted to the output thread, then
+ * either shiftout_begin and shiftout_end or frame_elided. Kernels before
+ * 2.6.32 get them as markers, see below.
+ */
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM ledfloor
+
+#if !defined(_LEDFLOOR_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _LEDFLOOR_TRACE_H
+
+#include <linux/types.h>
+#include <linux/version.h>
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 32)
+#include <linux/tracepoint.h>
+
+TRACE_EVENT(ledfloor_write_start,
+	TP_PROTO(size_t count, loff_t pos),
+	TP_ARGS(count, pos),
+	TP_STRUCT__entry(
+		__field(size_t, count)
+		__field(loff_t, pos)
+	),
+	TP_fast_assign(
+		__entry->count = count;
+		__entry->pos = pos;
+	),
+	TP_printk("count=%zu pos=%lld", __entry->count, __entry->pos)
+);
+
+/* slot is the frame slot posted, coalesced whether it replaced a frame that
+ * was never clocked out */
+TRACE_EVENT(ledfloor_frame_complete,
+	TP_PROTO(unsigned int slot, bool coalesced),
+	TP_ARGS(slot, coalesced),
+	TP_STRUCT__entry(
+		__field(unsigned int, slot)
+		__field(bool, coalesced)
+	),
+	TP_fast_assign(
+		__entry->slot = slot;
+		__entry->coalesced = coalesced;
+	),
+	TP_printk("slot=%u coalesced=%d", __entry->slot, __entry->coalesced)
+);
+
+TRACE_EVENT(ledfloor_frame_elided,
+	TP_PROTO(unsigned int fnum),
+	TP_ARGS(fnum),
+	TP_STRUCT__entry(
+		__field(unsigned int, fnum)
+	),
+	TP_fast_assign(
+		__entry->fnum = fnum;
+	),
+	TP_printk("fnum=%u", __entry->fnum)
+);
+
+TRACE_EVENT(ledfloor_shiftout_begin,
+	TP_PROTO(unsigned int fnum, unsigned int nwords),
+	TP_ARGS(fnum, nwords),
+	TP_STRUCT__entry(
+		__field(unsigned int, fnum)
+		__field(unsigned int, nwords)
+	),
+	TP_fast_assign(
+		__entry->fnum = fnum;
+		__entry->nwords = nwords;
+	),
+	TP_printk("fnum=%u nwords=%u", __entry->fnum, __entry->nwords)
+);
+
+/* Cycle counter ticks spent clocking out and latching the frame, of which
+ * wait_cycles were spent waiting for edges */
+TRACE_EVENT(ledfloor_shiftout_end,
+	TP_PROTO(unsigned int fnum, uint32_t cycles, uint32_t wait_cycles),
+	TP_ARGS(fnum, cycles, wait_cycles),
+	TP_STRUCT__entry(
+		__field(unsigned int, fnum)
+		__field(uint32_t, cycles)
+		__field(uint32_t, wait_cycles)
+	),
+	TP_fast_assign(
+		__entry->fnum = fnum;
+		__entry->cycles = cycles;
+		__entry->wait_cycles = wait_cycles;
+	),
+	TP_printk("fnum=%u cycles=%u wait_cycles=%u", __entry->fnum,
+		__entry->cycles, __entry->wait_cycles)
+);
+
+/* A reader blocked in read() or LF_IOCWAITFRAME got the frame it waited
+ * for, fnum is the last frame clocked out */
+TRACE_EVENT(ledfloor_reader_wakeup,
+	TP_PROTO(unsigned int fnum),
+	TP_ARGS(fnum),
+	TP_STRUCT__entry(
+		__field(unsigned int, fnum)
+	),
+	TP_fast_assign(
+		__entry->fnum = fnum;
+	),
+	TP_printk("fnum=%u", __entry->fnum)
+);
+
+TRACE_EVENT(ledfloor_config,
+	TP_PROTO(const char *param, unsigned int value),
+	TP_ARGS(param, value),
+	TP_STRUCT__entry(
+		__string(param, param)
+		__field(unsigned int, value)
+	),
+	TP_fast_assign(
+		__assign_str(param, param);
+		__entry->value = value;
+	),
+	TP_printk("%s=%u", __get_str(param), __entry->value)
+);
+
+#else
+/* No TRACE_EVENT() before 2.6.32, the events go to kernel markers instead,
+ * under the same names and with the same fields. They compile to nothing
+ * without CONFIG_MARKERS.
+ */
+#include <linux/marker.h>
+
+static inline void trace_ledfloor_write_start(size_t count, loff_t pos)
+{
+	trace_mark(ledfloor_write_start, "count %zu pos %lld", count,
+		(long long)pos);
+}
+
+static inline void trace_ledfloor_frame_complete(unsigned int slot, bool
+	coalesced)
+{
+	trace_mark(ledfloor_frame_complete, "slot %u coalesced %d", slot,
+		coalesced);
+}
+
+static inline void trace_ledfloor_frame_elided(unsigned int fnum)
+{
+	trace_mark(ledfloor_frame_elided, "fnum %u", fnum);
+}
+
+static inline void trace_ledfloor_shiftout_begin(unsigned int fnum, unsigned
+	int nwords)
+{
+	trace_mark(ledfloor_shiftout_begin, "fnum %u nwords %u", fnum,
+		nwords);
+}
+
+static inline void trace_ledfloor_shiftout_end(unsigned int fnum, uint32_t
+	cycles, uint32_t wait_cycles)
+{
+	trace_mark(ledfloor_shiftout_end, "fnum %u cycles %u wait_cycles %u",
+		fnum, cycles, wait_cycles);
+}
+
+static inline void trace_ledfloor_reader_wakeup(unsigned int fnum)
+{
+	trace_mark(ledfloor_reader_wakeup, "fnum %u", fnum);
+}
+
+static inline void trace_ledfloor_config(const char *param, unsigned int
+	value)
+{
+	trace_mark(ledfloor_config, "param %s value %u", param, value);
+}
+#endif
+
+#endif /* _LEDFLOOR_TRACE_H */
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 32)
+/* Found through the -I$(src) in Makefile */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#define TRACE_INCLUDE_FILE ledfloor_trace
+#include <trace/define_trace.h>
+#endif
@@ -0,0 +1,275 @@
+/*
+ * Microbenchmarks of the output engine, built from the same source as the
+ * driver. Each case renders or shifts out random frames in a loop and
+ * reports the time and the number of user space instructions per frame,
+ * the latter through perf_event_open(2). Instructions are shown as n/a when
+ * the counter is not available, see /proc/sys/kernel/perf_event_paranoid.
+ *
+ * Usage: lfbench [-n frames]
+ */
+#include <errno.h>
+#include <linux/perf_event.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <ledfloor_engine.h>
+
+enum action
+{
+	RENDER,
+	RENDER_COLUMNS,
+	WRITE,
+};
+
+struct case_t
+{
+	const char* name;
+	enum action action;
+	unsigned int rows;
+	unsigned int cols;
+	unsigned int format;
+	// spread the data lines over two ports
+	bool split;
+	// random calibration classes and gains
+	bool calibrate;
+	// columns clocked out between preemption points, 0 for all
+	unsigned int chunkCols;
+	// how the lines are written, see ledfloor_setup_clock()
+	unsigned int backend;
+};
+
+static const struct case_t cases[]= {
+	{"render 24x48 rgb888", RENDER, LFROWS, LFCOLS, LF_FMT_RGB888, false, false, 0, LF_BACKEND_PIO},
+	{"render 24x48 rgb16", RENDER, LFROWS, LFCOLS, LF_FMT_RGB16, false, false, 0, LF_BACKEND_PIO},
+	{"render 24x48 index8", RENDER, LFROWS, LFCOLS, LF_FMT_INDEX8, false, false, 0, LF_BACKEND_PIO},
+	{"render 24x48 rgb565", RENDER, LFROWS, LFCOLS, LF_FMT_RGB565, false, false, 0, LF_BACKEND_PIO},
+	{"render 24x48 rgb444", RENDER, LFROWS, LFCOLS, LF_FMT_RGB444, false, false, 0, LF_BACKEND_PIO},
+	{"render 24x48 rgb888 calib", RENDER, LFROWS, LFCOLS, LF_FMT_RGB888, false, true, 0, LF_BACKEND_PIO},
+	{"render 24x48 index8 calib", RENDER, LFROWS, LFCOLS, LF_FMT_INDEX8, false, true, 0, LF_BACKEND_PIO},
+	{"render 24x47 rgb888", RENDER, LFROWS, LFCOLS - 1, LF_FMT_RGB888, false, false, 0, LF_BACKEND_PIO},
+	{"render 48x48 rgb888 2 ports", RENDER, 2 * LFROWS, LFCOLS, LF_FMT_RGB888, true, false, 0, LF_BACKEND_PIO},
+	{"render 8 columns rgb888", RENDER_COLUMNS, LFROWS, LFCOLS, LF_FMT_RGB888, false, false, 0, LF_BACKEND_PIO},
+	{"shift-out 24x48", WRITE, LFROWS, LFCOLS, LF_FMT_RGB888, false, false, 0, LF_BACKEND_PIO},
+	{"shift-out 24x48 chunks of 8", WRITE, LFROWS, LFCOLS, LF_FMT_RGB888, false, false, 8, LF_BACKEND_PIO},
+	{"shift-out 48x48 2 ports", WRITE, 2 * LFROWS, LFCOLS, LF_FMT_RGB888, true, false, 0, LF_BACKEND_PIO},
+	{"shift-out 24x48 gpiolib", WRITE, LFROWS, LFCOLS, LF_FMT_RGB888, false, false, 0, LF_BACKEND_GPIOLIB},
+	{"shift-out 48x48 2 ports gpiolib", WRITE, 2 * LFROWS, LFCOLS, LF_FMT_RGB888, true, false, 0, LF_BACKEND_GPIOLIB},
+};
+
+static int perfFd= -1;
+
+
+static void openCounter(void)
+{
+	struct perf_event_attr attr;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.size= sizeof(attr);
+	attr.type= PERF_TYPE_HARDWARE;
+	attr.config= PERF_COUNT_HW_INSTRUCTIONS;
+	attr.disabled= 1;
+	attr.exclude_kernel= 1;
+	attr.exclude_hv= 1;
+
+	perfFd= syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+	if (perfFd == -1)
+	{
+		fprintf(stderr, "Warning: can't count instructions: %s\n", strerror(errno));
+	}
+}
+
+
+static uint64_t readCounter(void)
+{
+	uint64_t count;
+
+	if (perfFd == -1 || read(perfFd, &count, sizeof(count)) != sizeof(count))
+	{
+		return 0;
+	}
+
+	return count;
+}
+
+
+static uint64_t now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+
+// The tables of gammatable.py or a straight 8 to 12 bit conversion
+static void fillLut(struct ledfloor_lut* lut, bool gamma, bool calibrate)
+{
+	unsigned int c, i, k;
+
+	for (c= 0; c < 3; c++)
+	{
+		for (i= 0; i < 256; i++)
+		{
+			uint16_t value= i * 4095 / 255, entry= 0;
+
+			for (k= 0; k < 12; k++)
+			{
+				entry|= ((value >> k) & 1) << (11 - k);
+			}
+			lut->channels[c][i]= gamma ? gamma_c[i] : entry ^ 0xfff;
+		}
+	}
+	for (i= 0; i < 256; i++)
+	{
+		memset(lut->palette_rgb[i], i, sizeof(lut->palette_rgb[i]));
+	}
+	for (i= 0; i < LF_GAIN_CLASSES; i++)
+	{
+		lut->gains[i]= calibrate ? LF_GAIN_ONE / 2 + rand() % LF_GAIN_ONE : LF_GAIN_ONE;
+	}
+	ledfloor_derive_lut(lut);
+}
+
+
+static int runCase(const struct case_t* bench, bool gamma, bool rotate, unsigned int frames)
+{
+	static uint8_t pixels[LF_MAX_FRAME_SIZE];
+	static uint8_t classes[LF_MAXROWS * LF_MAXCOLS * 3];
+	static struct ledfloor_output output;
+	static struct ledfloor_lut lut;
+	struct ledfloor_engine engine;
+	struct ledfloor_timing timing;
+	int data[LF_MAXROWS];
+	unsigned int i;
+	uint64_t start, ns, instructions;
+	int retval;
+
+	// lines 0 to 23 of port B, then of port C
+	for (i= 0; i < bench->rows; i++)
+	{
+		data[i]= (bench->split && i >= bench->rows / 2 ? 64 : 32) + i % 24;
+	}
+	ledfloor_setup_clock(&engine, 31, 30, bench->backend);
+	retval= ledfloor_setup_engine(&engine, data, bench->rows, bench->cols, rotate, bench->format);
+	if (retval < 0)
+	{
+		fprintf(stderr, "%s: ledfloor_setup_engine: %s\n", bench->name, strerror(-retval));
+		return retval;
+	}
+	fillLut(&lut, gamma, bench->calibrate);
+	if (bench->calibrate)
+	{
+		for (i= 0; i < bench->rows * bench->cols * 3; i++)
+		{
+			classes[i]= rand() % LF_GAIN_CLASSES;
+		}
+		retval= ledfloor_setup_gains(&engine, classes);
+		if (retval < 0)
+		{
+			fprintf(stderr, "%s: ledfloor_setup_gains: %s\n", bench->name, strerror(-retval));
+			return retval;
+		}
+	}
+	for (i= 0; i < sizeof(pixels); i++)
+	{
+		pixels[i]= rand();
+	}
+	ledfloor_render(&engine, &lut, pixels, &output);
+
+	if (perfFd != -1)
+	{
+		ioctl(perfFd, PERF_EVENT_IOC_RESET, 0);
+		ioctl(perfFd, PERF_EVENT_IOC_ENABLE, 0);
+	}
+	start= now();
+	for (i= 0; i < frames; i++)
+	{
+		switch (bench->action)
+		{
+			case RENDER:
+				ledfloor_render(&engine, &lut, pixels, &output);
+				break;
+
+			case RENDER_COLUMNS:
+				ledfloor_render_columns(&engine, &lut, pixels, &output, i % (bench->cols - 7), 8);
+				break;
+
+			case WRITE:
+				ledfloor_write_frame(&engine, &output, 0, 0, bench->chunkCols, &timing);
+				break;
+		}
+	}
+	ns= now() - start;
+	if (perfFd != -1)
+	{
+		ioctl(perfFd, PERF_EVENT_IOC_DISABLE, 0);
+	}
+	instructions= readCounter();
+
+	printf("%-32s %-7s %-6s %10.0f", bench->name, gamma ? "gamma_c" : "linear",
+		rotate ? "yes" : "no", (double) ns / frames);
+	if (perfFd != -1)
+	{
+		printf(" %12.0f\n", (double) instructions / frames);
+	}
+	else
+	{
+		printf(" %12s\n", "n/a");
+	}
+
+	return 0;
+}
+
+
+int main(int argc, char* argv[])
+{
+	unsigned int frames= 2000;
+	unsigned int c;
+	int option, gamma, rotate;
+	int retval= 0;
+
+	while ((option= getopt(argc, argv, "n:")) != -1)
+	{
+		switch (option)
+		{
+			case 'n':
+				frames= strtoul(optarg, NULL, 0);
+				break;
+
+			default:
+				fprintf(stderr, "Usage: %s [-n frames]\n", argv[0]);
+				return EXIT_FAILURE;
+		}
+	}
+	if (frames == 0)
+	{
+		fprintf(stderr, "At least one frame is needed\n");
+		return EXIT_FAILURE;
+	}
+
+	openCounter();
+	printf("%-32s %-7s %-6s %10s %12s\n", "case", "lut", "rotate", "ns/frame", "insns/frame");
+	for (c= 0; c < sizeof(cases) / sizeof(*cases); c++)
+	{
+		for (gamma= 1; gamma >= 0; gamma--)
+		{
+			for (rotate= 0; rotate <= 1; rotate++)
+			{
+				if (runCase(&cases[c], gamma, rotate, frames) < 0)
+				{
+					retval= EXIT_FAILURE;
+				}
+			}
+		}
+	}
+
+	return retval;
+}
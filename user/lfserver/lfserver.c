@@ -9,19 +9,18 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <sys/select.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
 #include <ledfloor.h>
 
-char* buffer= NULL;
-
 void pferror(const int errsv, const char* format, ...);
 
-uint16_t reverse12(uint16_t a);
 
 int main(int argc, char* argv[])
 {
@@ -33,8 +32,14 @@ int main(int argc, char* argv[])
 	const char* devPath= "/dev/ledfloor0";
 	bool verbose= false;
 	int ctlFd= 0;
-
-	ledFd= open(devPath, O_WRONLY);
+	uint8_t* slots;
+	size_t slotSize;
+	uint32_t slot;
+	struct lf_geometry geometry;
+	size_t legacyFrameSize;
+	uint32_t format= LF_FMT_RGB888;
+
+	ledFd= open(devPath, O_RDWR);
 	if (ledFd == -1)
 	{
 		pferror(errno, "Can't open ledfloor device");
@@ -91,10 +96,37 @@ int main(int argc, char* argv[])
 		printf("Listenning on %s:%u...\n", inet_ntoa(addr.sin_addr), portNum);
 	}
 
-	buffer= malloc(LFCOLS * 3 * LFROWS);
+	retval= ioctl(ledFd, LF_IOCGGEOMETRY, &geometry);
+	if (retval == -1)
+	{
+		pferror(errno, "line %d", __LINE__);
+		abort();
+	}
+	legacyFrameSize= LF_FRAME_SIZE(geometry.rows, geometry.cols, LF_FMT_RGB888);
+	retval= ioctl(ledFd, LF_IOCSFORMAT, &format);
+	if (retval == -1)
+	{
+		pferror(errno, "line %d", __LINE__);
+		abort();
+	}
+
+	// frames are received straight into the device's frame slots
+	slotSize= LF_SLOT_SIZE(getpagesize());
+	slots= mmap(NULL, LF_SLOTS * slotSize, PROT_READ | PROT_WRITE, MAP_SHARED, ledFd, 0);
+	if (slots == MAP_FAILED)
+	{
+		pferror(errno, "Can't map ledfloor frame slots");
+		abort();
+	}
+	retval= ioctl(ledFd, LF_IOCGSLOT, &slot);
+	if (retval == -1)
+	{
+		pferror(errno, "line %d", __LINE__);
+		abort();
+	}
+
 	while(true)
 	{
-		size_t done= 0;
 		fd_set rdfds;
 		int max= 0;
 
@@ -117,45 +149,113 @@ int main(int argc, char* argv[])
 
 		if (FD_ISSET(frameFd, &rdfds))
 		{
-			// read a frame
+			// read a frame or a palette, the payload goes straight into the slot
 			struct sockaddr_in srcAddr;
-			socklen_t addrLen;
-
-			addrLen= sizeof(srcAddr);
-			retval= recvfrom(frameFd, buffer + done, LFCOLS * 3 * LFROWS - done, 0, (struct sockaddr*) &srcAddr, &addrLen);
+			struct lf_packet packet;
+			struct iovec iov[2];
+			struct msghdr msg;
+			uint8_t* payload= slots + slot * slotSize;
+			size_t payloadSize;
+
+			iov[0].iov_base= &packet;
+			iov[0].iov_len= sizeof(packet);
+			iov[1].iov_base= payload;
+			iov[1].iov_len= slotSize;
+			memset(&msg, 0, sizeof(msg));
+			msg.msg_name= &srcAddr;
+			msg.msg_namelen= sizeof(srcAddr);
+			msg.msg_iov= iov;
+			msg.msg_iovlen= 2;
+			retval= recvmsg(frameFd, &msg, 0);
 			if (retval == -1)
 			{
 				pferror(errno, "Error reading from network");
 				abort();
 			}
 
-			done+= retval;
-
 			if (verbose)
 			{
 				printf("Received %d bytes from %s\n", retval, inet_ntoa(srcAddr.sin_addr));
 			}
 
-			// write a frame
-			if (done == LFCOLS * 3 * LFROWS)
+			if (retval == legacyFrameSize)
+			{
+				// headerless RGB888 frame, its first bytes landed in packet
+				memmove(payload + sizeof(packet), payload, legacyFrameSize - sizeof(packet));
+				memcpy(payload, &packet, sizeof(packet));
+				packet.type= LF_PACKET_FRAME;
+				packet.format= LF_FMT_RGB888;
+				payloadSize= legacyFrameSize;
+			}
+			else if (retval >= sizeof(packet) && memcmp(packet.magic, LF_PACKET_MAGIC, sizeof(packet.magic)) == 0)
+			{
+				payloadSize= retval - sizeof(packet);
+			}
+			else
+			{
+				fprintf(stderr, "Warning: dropped a datagram of %d bytes without header\n", retval);
+				continue;
+			}
+
+			if (packet.type == LF_PACKET_PALETTE)
+			{
+				if (payloadSize != sizeof(struct lf_palette))
+				{
+					fprintf(stderr, "Warning: dropped a palette of %zu bytes\n", payloadSize);
+					continue;
+				}
+				retval= ioctl(ledFd, LF_IOCSPALETTE, payload);
+				if (retval == -1)
+				{
+					pferror(errno, "Error setting ledfloor palette");
+					abort();
+				}
+			}
+			else if (packet.type == LF_PACKET_FRAME)
 			{
-				done= 0;
-				while (done < LFCOLS * 3 * LFROWS)
+				if (packet.format >= LF_FMT_NB || payloadSize != LF_FRAME_SIZE(geometry.rows, geometry.cols, packet.format))
 				{
-					retval= write(ledFd, buffer + done, LFCOLS * 3 * LFROWS - done);
+					fprintf(stderr, "Warning: dropped a frame of %zu bytes in format %u\n", payloadSize, packet.format);
+					continue;
+				}
+				if (packet.format != format)
+				{
+					format= packet.format;
+					retval= ioctl(ledFd, LF_IOCSFORMAT, &format);
 					if (retval == -1)
 					{
-						pferror(errno, "Error writing to ledfloor");
+						pferror(errno, "line %d", __LINE__);
 						abort();
 					}
+				}
+
+				// 16 bit values come in network byte order, the device takes them in host order
+				if (packet.format == LF_FMT_RGB565 || packet.format == LF_FMT_RGB16)
+				{
+					uint16_t* values= (uint16_t*) payload;
+					size_t i;
 
-					done+= retval;
+					for (i= 0; i < payloadSize / sizeof(*values); i++)
+					{
+						values[i]= ntohs(values[i]);
+					}
+				}
+
+				// display the frame
+				retval= ioctl(ledFd, LF_IOCCOMMIT, &slot);
+				if (retval == -1)
+				{
+					pferror(errno, "Error committing frame to ledfloor");
+					abort();
 				}
 				if (verbose)
 				{
 					printf("Wrote a frame\n");
 				}
-				done= 0;
+			}
+			else
+			{
+				fprintf(stderr, "Warning: unknown packet type %u\n", packet.type);
 			}
 		}
 		else if (FD_ISSET(ctlListenFd, &rdfds))
@@ -217,7 +317,7 @@ int main(int argc, char* argv[])
 			}
 			else
 			{
-				static uint16_t gamma_c[256];
+				static struct lf_luts luts;
 				int i;
 
 				command.latch_ndelay= ntohl(command.latch_ndelay);
@@ -234,12 +334,35 @@ int main(int argc, char* argv[])
 					pferror(errno, "line %d", __LINE__);
 					abort();
 				}
+				if (verbose)
+				{
+					struct lf_timing timing;
+
+					// achieved by the last frame, with the previous delays
+					retval= ioctl(ledFd, LF_IOCGTIMING, &timing);
+					if (retval == 0)
+					{
+						printf("Clock period: %u ns latch: %u ns\n",
+							timing.clk_period_ns, timing.latch_ns);
+					}
+					else if (errno != ENODATA)
+					{
+						pferror(errno, "line %d", __LINE__);
+						abort();
+					}
+				}
 
+				// contrast and brightness are neutral at 0.5
 				for (i= 0; i < 256; i++)
 				{
-					gamma_c[i]= reverse12(floor(pow((double) i / 255., command.gamma) * 4095));
+					double value= ((double) i / 255. - 0.5) * 2 * command.contrast + command.brightness;
+
+					value= fmin(fmax(value, 0.), 1.);
+					luts.channels[0][i]= round(pow(value, command.gamma) * 4095);
 				}
-				retval= ioctl(ledFd, LF_IOCSGAMMATABLE, gamma_c);
+				memcpy(luts.channels[1], luts.channels[0], sizeof(luts.channels[0]));
+				memcpy(luts.channels[2], luts.channels[0], sizeof(luts.channels[0]));
+				retval= ioctl(ledFd, LF_IOCSLUTS, &luts);
 				if (retval == -1)
 				{
 					pferror(errno, "line %d", __LINE__);
@@ -314,18 +437,3 @@ void pferror(const int errsv, const char* format, ...)
 	}
 }
 
-
-uint16_t reverse12(uint16_t a)
-{
-	uint16_t b= 0;
-	int i;
-
-	for (i= 0; i < 12; i++)
-	{
-		b<<= 1;
-		b|= a & 1;
-		a>>= 1;
-	}
-
-	return b;
-}
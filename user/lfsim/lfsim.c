@@ -0,0 +1,555 @@
+/*
+ * Simulator of the floor hardware for the output engine of the driver. The
+ * engine is linked in as is and its port writes go to a model of the PIO
+ * controller, of the inverting buffers and of one chain of TLC5947 per data
+ * line. The values latched by the chains are decoded back into a frame and
+ * checked against the look up table, so that changes to the output path can
+ * be verified bit for bit without the board.
+ *
+ * Usage: lfsim [-r | -s] [-b] [-g] [-G] [-c clk_cycles] [-l latch_cycles]
+ *        [-p chunk_cols] [-o output] [frame.buffer...]
+ *   -r  render with the 180 degrees rotation
+ *   -s  render for chains laid serpentine, every other one mirrored, with
+ *       LF_IOCSMAP
+ *   -b  spread the data lines over two ports
+ *   -g  calibrate, component n in class n % LF_GAIN_CLASSES, class g having
+ *       a gain of 1 - g / 16, with LF_IOCSGAINS
+ *   -G  write the lines through the GPIO framework, LF_BACKEND_GPIOLIB,
+ *       each call acting like a write to SODR or CODR
+ *   -c  minimum half clock period, in cycle counter ticks
+ *   -l  minimum latch delay, in cycle counter ticks
+ *   -p  clock out chunk_cols columns at a time, the engine being preempted
+ *       for PREEMPT_CYCLES in between
+ *   -o  write the decoded frames to output, as RGB888
+ * Frames are RGB888 at the default geometry, LFROWS x LFCOLS.
+ */
+#include <errno.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <ledfloor_engine.h>
+
+#define NPORTS 5
+#define CHIP_CHANNELS 24
+#define CHAIN_BITS (LF_MAXCOLS * 3 * 12 + CHIP_CHANNELS * 12)
+#define PREEMPT_CYCLES 100000
+
+// As wired on the board, see ledfloor_config_data
+#define PIN(port, n) ((port) * 32 + (n))
+#define PORT_A 0
+#define PORT_B 1
+#define PORT_C 2
+static const int clkPin= PIN(PORT_A, 31);
+static const int latchPin= PIN(PORT_A, 30);
+static const int boardData[LFROWS]= {
+	PIN(PORT_B, 4), PIN(PORT_B, 3), PIN(PORT_B, 0), PIN(PORT_B, 5),
+	PIN(PORT_B, 2), PIN(PORT_B, 1), PIN(PORT_B, 16), PIN(PORT_B, 15),
+	PIN(PORT_B, 12), PIN(PORT_B, 17), PIN(PORT_B, 14), PIN(PORT_B, 13),
+	PIN(PORT_B, 11), PIN(PORT_B, 6), PIN(PORT_B, 7), PIN(PORT_B, 10),
+	PIN(PORT_B, 9), PIN(PORT_B, 8), PIN(PORT_B, 19), PIN(PORT_B, 18),
+	PIN(PORT_B, 21), PIN(PORT_B, 20), PIN(PORT_B, 23), PIN(PORT_B, 22),
+};
+
+// PIO controller, output data and output write enable of each port
+struct port_t
+{
+	uint32_t odsr;
+	uint32_t owsr;
+};
+
+/*
+ * One chain of TLC5947 shift registers, fed by a data line. The bit clocked
+ * in last is at position 0, the least significant bit of channel 0 of the
+ * first chip. Channel q is made of bits 12 * q to 12 * q + 11.
+ */
+struct chain_t
+{
+	uint8_t bits[CHAIN_BITS];
+	unsigned int head;
+	uint16_t latched[CHAIN_BITS / 12];
+};
+
+static struct port_t ports[NPORTS];
+static struct chain_t chains[LFROWS];
+static const int* data;
+static unsigned int chainBits;
+
+static uint32_t cycles;
+static unsigned long writes, gpioWrites, clocks, latches;
+// Cycle counter value at the last clock and latch edges
+static uint32_t clkEdge, latchEdge;
+static uint32_t minClkHigh= UINT32_MAX, minClkLow= UINT32_MAX;
+static uint32_t minLatchSetup= UINT32_MAX;
+
+static bool pinLevel(int pin)
+{
+	return ports[pin / 32].odsr & (1 << pin % 32);
+}
+
+
+// The buffers between the board and the floor invert every line
+static void clockChains(void)
+{
+	unsigned int i;
+
+	for (i= 0; i < LFROWS; i++)
+	{
+		struct chain_t* chain= &chains[i];
+
+		chain->head= (chain->head + chainBits - 1) % chainBits;
+		chain->bits[chain->head]= !pinLevel(data[i]);
+	}
+	clocks++;
+}
+
+
+static void latchChains(void)
+{
+	unsigned int i, q, k;
+
+	for (i= 0; i < LFROWS; i++)
+	{
+		struct chain_t* chain= &chains[i];
+
+		for (q= 0; q < chainBits / 12; q++)
+		{
+			uint16_t value= 0;
+
+			for (k= 0; k < 12; k++)
+			{
+				value|= chain->bits[(chain->head + q * 12 + k) % chainBits] << k;
+			}
+			chain->latched[q]= value;
+		}
+	}
+	latches++;
+}
+
+
+void ledfloor_host_writel(uint32_t value, void* addr)
+{
+	uintptr_t offset= (uintptr_t) addr - GPIO_HW_BASE;
+	struct port_t* port;
+	bool clk, latch;
+
+	if (offset >= NPORTS * GPIO_PORT_SIZE)
+	{
+		fprintf(stderr, "Write of 0x%08x outside of the PIO controller at %p\n", value, addr);
+		abort();
+	}
+	port= &ports[offset / GPIO_PORT_SIZE];
+	clk= pinLevel(clkPin);
+	latch= pinLevel(latchPin);
+	writes++;
+
+	switch (offset % GPIO_PORT_SIZE)
+	{
+		case PIO_SODR:
+			port->odsr|= value;
+			break;
+
+		case PIO_CODR:
+			port->odsr&= ~value;
+			break;
+
+		case PIO_ODSR:
+			port->odsr= (port->odsr & ~port->owsr) | (value & port->owsr);
+			break;
+
+		case PIO_OWER:
+			port->owsr|= value;
+			break;
+
+		case PIO_OWDR:
+			port->owsr&= ~value;
+			break;
+
+		default:
+			fprintf(stderr, "Write to unknown PIO register 0x%03lx\n",
+				(unsigned long) (offset % GPIO_PORT_SIZE));
+			abort();
+	}
+
+	// SCLK and XLAT rise on the falling edge of the lines
+	if (clk != pinLevel(clkPin))
+	{
+		if (clk)
+		{
+			if (cycles - clkEdge < minClkHigh)
+			{
+				minClkHigh= cycles - clkEdge;
+			}
+			clockChains();
+		}
+		else if (clocks && cycles - clkEdge < minClkLow)
+		{
+			minClkLow= cycles - clkEdge;
+		}
+		clkEdge= cycles;
+	}
+	if (latch != pinLevel(latchPin))
+	{
+		if (latch)
+		{
+			if (cycles - clkEdge < minLatchSetup)
+			{
+				minLatchSetup= cycles - clkEdge;
+			}
+			latchChains();
+		}
+		latchEdge= cycles;
+	}
+}
+
+
+uint32_t ledfloor_host_readl(void* addr)
+{
+	uintptr_t offset= (uintptr_t) addr - GPIO_HW_BASE;
+
+	if (offset >= NPORTS * GPIO_PORT_SIZE || offset % GPIO_PORT_SIZE != PIO_OWSR)
+	{
+		fprintf(stderr, "Read of unexpected PIO register at %p\n", addr);
+		abort();
+	}
+
+	return ports[offset / GPIO_PORT_SIZE].owsr;
+}
+
+
+// Each read advances the counter, busy waits end
+uint32_t ledfloor_host_cycles(void)
+{
+	return cycles++;
+}
+
+
+void ledfloor_host_gpio_set(unsigned int gpio, int value)
+{
+	gpioWrites++;
+	ledfloor_host_writel(1 << gpio % 32, (void*) (GPIO_HW_BASE + gpio / 32 *
+			GPIO_PORT_SIZE + (value ? PIO_SODR : PIO_CODR)));
+}
+
+
+// Something else runs for a while, the lines are left as they are
+void ledfloor_host_yield(void)
+{
+	cycles+= PREEMPT_CYCLES;
+}
+
+
+// 12 bit PWM value of an entry of gamma_c
+static uint16_t pwmValue(uint16_t entry)
+{
+	uint16_t value= 0;
+	int k;
+
+	for (k= 0; k < 12; k++)
+	{
+		value|= ((entry >> k) & 1) << (11 - k);
+	}
+
+	return value ^ 0xfff;
+}
+
+
+int main(int argc, char* argv[])
+{
+	struct ledfloor_engine engine;
+	static struct ledfloor_output output;
+	static struct ledfloor_lut lut;
+	struct ledfloor_timing timing;
+	int wiring[LFROWS];
+	uint16_t pwm[256];
+	uint8_t inverse[4096];
+	const size_t frameSize= LF_FRAME_SIZE(LFROWS, LFCOLS, LF_FMT_RGB888);
+	uint8_t pixels[LF_FRAME_SIZE(LFROWS, LFCOLS, LF_FMT_RGB888)];
+	uint8_t decoded[LF_FRAME_SIZE(LFROWS, LFCOLS, LF_FMT_RGB888)];
+	static const char* defaultFrames[]= {"../testClassic.buffer", "../testNew.buffer"};
+	const char** frames;
+	int nframes;
+	bool rotate= false, serpentine= false, split= false, calibrate= false;
+	unsigned int backend= LF_BACKEND_PIO;
+	static uint8_t classes[LF_FRAME_SIZE(LFROWS, LFCOLS, LF_FMT_RGB888)];
+	static uint16_t map[LFROWS * LFCOLS];
+	bool bgr;
+	uint32_t clkCycles= 0, latchCycles= 0;
+	unsigned int chunkCols= 0;
+	const char* outputPath= NULL;
+	FILE* outputFile= NULL;
+	unsigned long mismatches= 0, roundTrips= 0;
+	int option, retval, f, c;
+	unsigned int i, j;
+
+	while ((option= getopt(argc, argv, "rsbgGc:l:p:o:")) != -1)
+	{
+		switch (option)
+		{
+			case 'r':
+				rotate= true;
+				break;
+
+			case 's':
+				serpentine= true;
+				break;
+
+			case 'b':
+				split= true;
+				break;
+
+			case 'g':
+				calibrate= true;
+				break;
+
+			case 'G':
+				backend= LF_BACKEND_GPIOLIB;
+				break;
+
+			case 'c':
+				clkCycles= strtoul(optarg, NULL, 0);
+				break;
+
+			case 'l':
+				latchCycles= strtoul(optarg, NULL, 0);
+				break;
+
+			case 'p':
+				chunkCols= strtoul(optarg, NULL, 0);
+				break;
+
+			case 'o':
+				outputPath= optarg;
+				break;
+
+			default:
+				fprintf(stderr, "Usage: %s [-r | -s] [-b] [-g] [-G] [-c clk_cycles] [-l latch_cycles] [-p chunk_cols] [-o output] [frame.buffer...]\n", argv[0]);
+				return EXIT_FAILURE;
+		}
+	}
+	if (optind < argc)
+	{
+		frames= (const char**) &argv[optind];
+		nframes= argc - optind;
+	}
+	else
+	{
+		frames= defaultFrames;
+		nframes= sizeof(defaultFrames) / sizeof(*defaultFrames);
+	}
+
+	// the second half of the rows on port C, same lines
+	memcpy(wiring, boardData, sizeof(wiring));
+	if (split)
+	{
+		for (i= LFROWS / 2; i < LFROWS; i++)
+		{
+			wiring[i]= PIN(PORT_C, wiring[i] % 32);
+		}
+	}
+	data= wiring;
+
+	ledfloor_setup_clock(&engine, clkPin, latchPin, backend);
+	retval= ledfloor_setup_engine(&engine, wiring, LFROWS, LFCOLS, rotate, LF_FMT_RGB888);
+	if (retval < 0)
+	{
+		fprintf(stderr, "ledfloor_setup_engine: %s\n", strerror(-retval));
+		return EXIT_FAILURE;
+	}
+
+	/*
+	 * Pixel shown by LED k of chain i. Chain i shows row i, or rows - 1 - i
+	 * when rotated, which also reverses the columns and the components.
+	 */
+	for (i= 0; i < LFROWS; i++)
+	{
+		for (j= 0; j < LFCOLS; j++)
+		{
+			if (serpentine)
+			{
+				map[i * LFCOLS + j]= i * LFCOLS + (i % 2 ? LFCOLS - 1 - j : j);
+			}
+			else if (rotate)
+			{
+				map[i * LFCOLS + j]= (LFROWS - 1 - i) * LFCOLS + LFCOLS - 1 - j;
+			}
+			else
+			{
+				map[i * LFCOLS + j]= i * LFCOLS + j;
+			}
+		}
+	}
+	bgr= rotate;
+	if (serpentine)
+	{
+		retval= ledfloor_setup_map(&engine, map, 0);
+		if (retval < 0)
+		{
+			fprintf(stderr, "ledfloor_setup_map: %s\n", strerror(-retval));
+			return EXIT_FAILURE;
+		}
+	}
+	chainBits= (LFCOLS * 3 + CHIP_CHANNELS - 1) / CHIP_CHANNELS * CHIP_CHANNELS * 12;
+
+	// the tables loaded at probe time, gamma_c on every channel
+	for (c= 0; c < 3; c++)
+	{
+		memcpy(lut.channels[c], gamma_c, sizeof(gamma_c));
+	}
+	for (i= 0; i < 256; i++)
+	{
+		memset(lut.palette_rgb[i], i, sizeof(lut.palette_rgb[i]));
+	}
+	for (i= 0; i < LF_GAIN_CLASSES; i++)
+	{
+		lut.gains[i]= calibrate ? LF_GAIN_ONE - i * LF_GAIN_ONE / 16 : LF_GAIN_ONE;
+	}
+	ledfloor_derive_lut(&lut);
+	if (calibrate)
+	{
+		for (i= 0; i < frameSize; i++)
+		{
+			classes[i]= i % LF_GAIN_CLASSES;
+		}
+		retval= ledfloor_setup_gains(&engine, classes);
+		if (retval < 0)
+		{
+			fprintf(stderr, "ledfloor_setup_gains: %s\n", strerror(-retval));
+			return EXIT_FAILURE;
+		}
+	}
+
+	// smallest component value for each PWM value
+	memset(inverse, 0, sizeof(inverse));
+	for (i= 256; i-- > 0;)
+	{
+		pwm[i]= pwmValue(gamma_c[i]);
+		inverse[pwm[i]]= i;
+	}
+
+	// lines idle high, as left by gpio_init()
+	for (i= 0; i < NPORTS; i++)
+	{
+		ports[i].odsr= ~0;
+	}
+
+	if (outputPath)
+	{
+		outputFile= fopen(outputPath, "w");
+		if (!outputFile)
+		{
+			fprintf(stderr, "Can't open %s: %s\n", outputPath, strerror(errno));
+			return EXIT_FAILURE;
+		}
+	}
+
+	for (f= 0; f < nframes; f++)
+	{
+		FILE* file;
+		unsigned long frameMismatches= 0;
+		unsigned long clocksBefore= clocks, latchesBefore= latches;
+
+		file= fopen(frames[f], "r");
+		if (!file)
+		{
+			fprintf(stderr, "Can't open %s: %s\n", frames[f], strerror(errno));
+			return EXIT_FAILURE;
+		}
+		if (fread(pixels, 1, frameSize, file) != frameSize)
+		{
+			fprintf(stderr, "%s is not a %ux%u RGB888 frame\n", frames[f], LFCOLS, LFROWS);
+			return EXIT_FAILURE;
+		}
+		fclose(file);
+
+		ledfloor_render(&engine, &lut, pixels, &output);
+		ledfloor_write_frame(&engine, &output, clkCycles, latchCycles, chunkCols, &timing);
+
+		if (clocks - clocksBefore != LFCOLS * 3 * 12 || latches - latchesBefore != 1)
+		{
+			fprintf(stderr, "%s: %lu clocks and %lu latches\n", frames[f],
+				clocks - clocksBefore, latches - latchesBefore);
+			return EXIT_FAILURE;
+		}
+		for (i= 0; i < NPORTS; i++)
+		{
+			if (ports[i].owsr)
+			{
+				fprintf(stderr, "Port %c left with write enable mask 0x%08x\n", 'A' + i, ports[i].owsr);
+				return EXIT_FAILURE;
+			}
+		}
+
+		// channels 3 * k to 3 * k + 2 of a chain are the R, G, B of LED k
+		for (i= 0; i < LFROWS; i++)
+		{
+			for (j= 0; j < LFCOLS * 3; j++)
+			{
+				const unsigned int pixel= map[i * LFCOLS + j / 3];
+				const unsigned int component= bgr ? 2 - j % 3 : j % 3;
+				const size_t index= pixel * 3 + component;
+				const uint16_t value= chains[i].latched[j];
+				uint32_t expected= pwm[pixels[index]];
+
+				if (calibrate)
+				{
+					const uint16_t gain= lut.gains[classes[index]];
+
+					expected= (expected * gain + LF_GAIN_ONE / 2) / LF_GAIN_ONE;
+					expected= expected > 0xfff ? 0xfff : expected;
+				}
+
+				if (value != expected)
+				{
+					if (frameMismatches < 10)
+					{
+						fprintf(stderr, "%s: row %u column %u component %u: PWM %u, expected %u\n",
+							frames[f], pixel / LFCOLS, pixel % LFCOLS, component, value,
+							expected);
+					}
+					frameMismatches++;
+				}
+				else if (inverse[value] == pixels[index])
+				{
+					roundTrips++;
+				}
+				decoded[index]= inverse[value];
+			}
+		}
+		mismatches+= frameMismatches;
+
+		if (outputFile && fwrite(decoded, 1, frameSize, outputFile) != frameSize)
+		{
+			fprintf(stderr, "Can't write %s: %s\n", outputPath, strerror(errno));
+			return EXIT_FAILURE;
+		}
+
+		printf("%s: %s, %u clocks, %u shift cycles, %u latch cycles, %u preemptions, held %u cycles\n",
+			frames[f], frameMismatches ? "MISMATCH" : "ok", timing.clocks,
+			timing.shift_cycles, timing.latch_cycles, timing.yields, timing.hold_cycles);
+	}
+
+	if (outputFile)
+	{
+		fclose(outputFile);
+	}
+
+	printf("%lu register writes, %lu through gpiolib, %lu clocks, %lu latches\n", writes,
+		gpioWrites, clocks, latches);
+	printf("%lu of %lu components decoded back to the value written\n", roundTrips,
+		(unsigned long) nframes * frameSize);
+	printf("shortest clock high %u, clock low %u, latch setup %u cycles\n", minClkHigh,
+		minClkLow, minLatchSetup);
+
+	if (minClkHigh < clkCycles || minClkLow < clkCycles || minLatchSetup < latchCycles)
+	{
+		fprintf(stderr, "Timing violation\n");
+		return EXIT_FAILURE;
+	}
+
+	return mismatches ? EXIT_FAILURE : EXIT_SUCCESS;
+}
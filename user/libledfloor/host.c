@@ -0,0 +1,60 @@
+/*
+ * Default port accesses for the output engine in user space. Writes, also
+ * those of LF_BACKEND_GPIOLIB, land in a copy of the PIO registers and the
+ * cycle counter advances on each read, so that the busy waits of the
+ * shift-out end right away, and nothing else runs at the preemption points.
+ * Programs that model the hardware, like lfsim, define their own.
+ */
+#include <stdint.h>
+
+#include <ledfloor_engine.h>
+
+static volatile uint32_t registers[5][GPIO_PORT_SIZE / 4];
+static uint32_t cycles;
+
+
+static volatile uint32_t* registerAt(void* addr)
+{
+	uintptr_t offset= ((uintptr_t) addr - GPIO_HW_BASE) % (sizeof(registers));
+
+	return &registers[offset / GPIO_PORT_SIZE][offset % GPIO_PORT_SIZE / 4];
+}
+
+
+void ledfloor_host_writel(uint32_t value, void* addr)
+{
+	*registerAt(addr)= value;
+}
+
+
+uint32_t ledfloor_host_readl(void* addr)
+{
+	return *registerAt(addr);
+}
+
+
+uint32_t ledfloor_host_cycles(void)
+{
+	return cycles++;
+}
+
+
+void ledfloor_host_yield(void)
+{
+}
+
+
+// The line of the copy of the PIO registers changes as with SODR and CODR
+void ledfloor_host_gpio_set(unsigned int gpio, int value)
+{
+	volatile uint32_t* odsr= &registers[gpio / 32 % 5][PIO_ODSR / 4];
+
+	if (value)
+	{
+		*odsr|= 1 << gpio % 32;
+	}
+	else
+	{
+		*odsr&= ~(1 << gpio % 32);
+	}
+}